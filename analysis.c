@@ -1,57 +1,406 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
+// The dither engines are linked in directly, so every sample times only the work itself:
+// no shell, fork/exec or dynamic linking. thread.c is included as a library (without its main)
+// and brings the PNG I/O, grayscale kernels and the ST/MT engines.
+#define DITHER_NO_MAIN
+#include "thread.c"
+
 #include <omp.h> // Necessary for omp_get_wtime()
 
 // --- Configuration ---
 #define MAX_THREADS 6
-#define EXECUTABLE_NAME "./thread" // Changed to match your executable name
-#define INPUT_FILE "input.png"     // *** CHANGE THIS to your input PNG file ***
+#define INPUT_FILE "input.png"     // *** CHANGE THIS to your input PNG file *** (or pass it as argv[1])
 #define OUTPUT_FILE "output.png"   // Temporary output file name
 #define RESULT_FILE "dithering_performance.csv"
-#define RUNS_PER_THREAD 5          // Number of times to run each thread count for averaging
+#define COUNTER_FILE "dithering_counters.csv"   // perf_event_open counters per phase and thread
+#define WARMUP_RUNS 2              // Untimed runs per thread count (page cache, allocator, CPU clocks)
+#define RUNS_PER_THREAD 15         // Timed runs per thread count
+
+// --- Sweep configuration (--sweep) ---
+#define SWEEP_FILE "dithering_sweep.csv"
+#define SWEEP_WARMUP_RUNS 1
+#define SWEEP_RUNS 5
+
+typedef struct {
+    double mean;
+    double median;
+    double p95;
+    double stddev;
+    double min;
+} SampleStats;
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Summarizes `count` samples; percentiles use the nearest-rank method.
+ * @param samples The samples in seconds (sorted in place).
+ */
+SampleStats compute_stats(double* samples, int count) {
+    SampleStats stats;
+    qsort(samples, count, sizeof(double), compare_doubles);
+
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) sum += samples[i];
+    stats.mean = sum / count;
+
+    double squares = 0.0;
+    for (int i = 0; i < count; i++) squares += (samples[i] - stats.mean) * (samples[i] - stats.mean);
+    stats.stddev = (count > 1) ? sqrt(squares / (count - 1)) : 0.0;
+
+    stats.median = (count % 2) ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2.0;
+    int rank = (int)ceil(0.95 * count);
+    stats.p95 = samples[(rank > 0 ? rank : 1) - 1];
+    stats.min = samples[0];
+    return stats;
+}
+
+// Per-run hardware counters: per phase for the whole run, and each MT worker on its own
+typedef struct {
+    PerfCounters process;      // this thread; the dither phase adds the workers below
+    PerfSample phases[NUM_PHASES];
+    PerfSample* threads;       // one per worker, filled by dither_image_mt
+} RunCounters;
+
+/**
+ * @brief Decodes, converts, dithers and encodes the input once, timing each phase.
+ * @param threads 1 runs the single-threaded engine, more the default MT scheduler.
+ * @param times Receives the seconds spent in each phase.
+ * @param counters If not NULL, also receives the hardware counters of each phase and worker.
+ * @return 0 on success, -1 if the input could not be read or the output could not be written.
+ */
+int run_dither_once(const char* input_file, int threads, double times[NUM_PHASES], RunCounters* counters) {
+    MtOptions mt_options = MT_OPTIONS_DEFAULTS;
+    const GrayscaleKernel* gray_kernel = find_grayscale_kernel("auto");
+    const DiffusionKernel* kernel = &diffusion_kernels[0];
+    PngWriteOptions write_options = PNG_WRITE_DEFAULTS;
+    if (counters) mt_options.thread_counters = counters->threads;
+
+    if (counters) perf_counters_start(&counters->process);
+    double start_time = omp_get_wtime();
+    PngImage* image = read_png_file(input_file);
+    times[PHASE_DECODE] = omp_get_wtime() - start_time;
+    if (counters) perf_counters_stop(&counters->process, &counters->phases[PHASE_DECODE]);
+    if (!image) return -1;
+
+    ImageBuffer* grayscale = create_image_buffer(image->width, image->height, 1);
+    ImageBuffer* dithered = create_image_buffer(image->width, image->height, 1);
+    if (!grayscale || !dithered) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+
+    if (counters) perf_counters_start(&counters->process);
+    start_time = omp_get_wtime();
+    for (int y = 0; y < image->height; y++) {
+        gray_kernel->convert(image_row(image->pixels, y), image_row(grayscale, y), image->width);
+    }
+    times[PHASE_GRAYSCALE] = omp_get_wtime() - start_time;
+    if (counters) perf_counters_stop(&counters->process, &counters->phases[PHASE_GRAYSCALE]);
+
+    if (counters) perf_counters_start(&counters->process);
+    start_time = omp_get_wtime();
+    if (threads <= 1) {
+        dither_image_st(grayscale, dithered, kernel, 0);
+    } else {
+        dither_image_mt(grayscale, dithered, threads, &mt_options, kernel, 0);
+    }
+    times[PHASE_DITHER] = omp_get_wtime() - start_time;
+    if (counters) perf_counters_stop(&counters->process, &counters->phases[PHASE_DITHER]);
+    for (int i = 0; counters && threads > 1 && i < threads; i++) {
+        perf_sample_add(&counters->phases[PHASE_DITHER], &counters->threads[i]);
+    }
+
+    if (counters) perf_counters_start(&counters->process);
+    start_time = omp_get_wtime();
+    int write_failed = write_png_file(OUTPUT_FILE, dithered, &write_options) != 0;
+    times[PHASE_ENCODE] = omp_get_wtime() - start_time;
+    if (counters) perf_counters_stop(&counters->process, &counters->phases[PHASE_ENCODE]);
+
+    free_image_buffer(grayscale);
+    free_image_buffer(dithered);
+    free_png_image(image);
+    if (write_failed) {
+        fprintf(stderr, "Error: Could not write %s\n", OUTPUT_FILE);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes one line of the counter CSV: the mean count per timed run, empty if unavailable.
+ * @param thread The worker index, or -1 for the whole process.
+ */
+void write_counter_row(FILE* fp, int threads, const char* phase, int thread, const PerfSample* sum) {
+    fprintf(fp, "%d,%s,", threads, phase);
+    if (thread >= 0) {
+        fprintf(fp, "%d", thread);
+    } else {
+        fprintf(fp, "all");
+    }
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (sum->value[i] >= 0) {
+            fprintf(fp, ",%lld", sum->value[i] / RUNS_PER_THREAD);
+        } else {
+            fprintf(fp, ",");
+        }
+    }
+    fprintf(fp, "\n");
+}
+
+/**
+ * @brief Runs WARMUP_RUNS untimed and RUNS_PER_THREAD timed iterations with one thread count.
+ * @param stats Receives the statistics of each phase.
+ * @param counter_fp If not NULL, the mean counters per phase and per worker are written to it.
+ * @return 0 on success, -1 on failure.
+ */
+int run_dither_and_time(const char* input_file, int threads, SampleStats stats[NUM_PHASES], FILE* counter_fp) {
+    double samples[NUM_PHASES][RUNS_PER_THREAD];
+    double times[NUM_PHASES];
+    RunCounters counters;
+    RunCounters* run_counters = NULL;
+    PerfSample phase_sums[NUM_PHASES];
+    PerfSample* thread_sums = NULL;
+
+    if (counter_fp) {
+        perf_counters_open(&counters.process);
+        counters.threads = (threads > 1) ? (PerfSample*)calloc(threads, sizeof(PerfSample)) : NULL;
+        thread_sums = (PerfSample*)calloc(threads, sizeof(PerfSample));
+        memset(phase_sums, 0, sizeof(phase_sums));
+        run_counters = &counters;
+    }
+
+    printf("  Running with %d threads (%d warm-up + %d timed runs)...\n", threads, WARMUP_RUNS, RUNS_PER_THREAD);
+
+    for (int i = 0; i < WARMUP_RUNS + RUNS_PER_THREAD; i++) {
+        if (run_dither_once(input_file, threads, times, run_counters) != 0) {
+            fprintf(stderr, "Error: Benchmark run on %s failed. Exiting.\n", input_file);
+            return -1;
+        }
+        if (i < WARMUP_RUNS) continue;
+        for (int phase = 0; phase < NUM_PHASES; phase++) {
+            samples[phase][i - WARMUP_RUNS] = times[phase];
+        }
+        if (!run_counters) continue;
+        for (int phase = 0; phase < NUM_PHASES; phase++) {
+            perf_sample_add(&phase_sums[phase], &counters.phases[phase]);
+        }
+        for (int t = 0; counters.threads && t < threads; t++) {
+            perf_sample_add(&thread_sums[t], &counters.threads[t]);
+        }
+    }
+
+    // Per-thread lines only exist for the MT engine and its dither phase
+    if (run_counters) {
+        for (int phase = 0; phase < NUM_PHASES; phase++) {
+            write_counter_row(counter_fp, threads, phase_names[phase], -1, &phase_sums[phase]);
+        }
+        for (int t = 0; counters.threads && t < threads; t++) {
+            write_counter_row(counter_fp, threads, phase_names[PHASE_DITHER], t, &thread_sums[t]);
+        }
+        perf_counters_close(&counters.process);
+        free(counters.threads);
+        free(thread_sums);
+    }
+
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        stats[phase] = compute_stats(samples[phase], RUNS_PER_THREAD);
+    }
+    return 0;
+}
+
+// ------------------------- Parameter Sweep -------------------------
+
+typedef struct {
+    int width;
+    int height;
+} SweepSize;
+
+// Square, HD, large square, and very wide / very tall (short or long wavefront diagonals)
+static const SweepSize sweep_sizes[] = {
+    {512, 512}, {1920, 1080}, {2048, 2048}, {4096, 256}, {256, 4096}
+};
+#define NUM_SWEEP_SIZES ((int)(sizeof(sweep_sizes) / sizeof(sweep_sizes[0])))
+
+// Smooth gradients give long runs of similar decisions; noise makes every threshold a coin flip
+enum { PATTERN_GRADIENT, PATTERN_NOISE, NUM_PATTERNS };
+static const char* const pattern_names[NUM_PATTERNS] = {"gradient", "noise"};
+
+// Every engine of thread.c that works on an in-memory plane; --pipeline needs a PNG file
+enum { ENGINE_ST, ENGINE_TILES, ENGINE_DIAGONAL, ENGINE_ROWS, ENGINE_BANDS, NUM_ENGINES };
+static const char* const engine_names[NUM_ENGINES] = {"st", "tiles", "diagonal", "rows", "bands"};
 
 /**
- * @brief Executes the dithering program and measures the time.
- * @param threads The number of threads to pass to the dither program.
- * @return The average execution time in seconds.
+ * @brief Builds an RGBA test image in memory, so the sweep needs no input files.
+ * @param pattern PATTERN_GRADIENT (ramps along x, y and the diagonal) or PATTERN_NOISE.
  */
-double run_dither_and_time(int threads) {
-    char command[512];
-    double total_time = 0.0;
-    
-    // The command string to execute the dithering program
-    // Format: ./thread input.png output.png <threads>
-    snprintf(command, sizeof(command), "%s %s %s %d", 
-             EXECUTABLE_NAME, INPUT_FILE, OUTPUT_FILE, threads);
-    
-    printf("  Running with %d threads (x%d times)...\n", threads, RUNS_PER_THREAD);
-
-    for (int i = 0; i < RUNS_PER_THREAD; i++) {
-        double start_time = omp_get_wtime();
-        
-        // Use system() to execute the compiled thread program
-        int result = system(command);
-        
-        double end_time = omp_get_wtime();
-        
-        if (result != 0) {
-            fprintf(stderr, "Error: Program %s failed for %d threads. Exiting.\n", EXECUTABLE_NAME, threads);
-            return -1.0; // Indicate failure
+ImageBuffer* make_synthetic_image(int pattern, int width, int height) {
+    ImageBuffer* image = create_image_buffer(width, height, 4);
+    if (!image) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    unsigned int state = 2463534242u;   // xorshift32, fixed seed so every run sees the same noise
+    for (int y = 0; y < height; y++) {
+        unsigned char* px = image_row(image, y);
+        for (int x = 0; x < width; x++, px += 4) {
+            if (pattern == PATTERN_GRADIENT) {
+                px[0] = (unsigned char)(x * 255 / (width > 1 ? width - 1 : 1));
+                px[1] = (unsigned char)(y * 255 / (height > 1 ? height - 1 : 1));
+                px[2] = (unsigned char)((x + y) * 255 / (width + height > 2 ? width + height - 2 : 1));
+            } else {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                px[0] = (unsigned char)state;
+                px[1] = (unsigned char)(state >> 8);
+                px[2] = (unsigned char)(state >> 16);
+            }
+            px[3] = 255;
         }
-        total_time += (end_time - start_time);
     }
+    return image;
+}
+
+/**
+ * @brief Dithers `input` once with the given engine and thread count.
+ */
+void run_engine(int engine, int threads, const ImageBuffer* input, ImageBuffer* output) {
+    static const Schedule schedules[NUM_ENGINES] = {
+        SCHEDULE_TILES, SCHEDULE_TILES, SCHEDULE_DIAGONAL, SCHEDULE_ROWS, SCHEDULE_TILES
+    };
+    const DiffusionKernel* kernel = &diffusion_kernels[0];
+    MtOptions mt_options = MT_OPTIONS_DEFAULTS;
+    mt_options.schedule = schedules[engine];
+
+    if (engine == ENGINE_ST) {
+        dither_image_st(input, output, kernel, 0);
+    } else if (engine == ENGINE_BANDS) {
+        dither_image_bands(input, output, threads, threads, DEFAULT_SEED_ROWS, kernel, 0, NULL);
+    } else {
+        dither_image_mt(input, output, threads, &mt_options, kernel, 0);
+    }
+}
 
-    return total_time / RUNS_PER_THREAD;
+/**
+ * @brief Writes one tidy CSV line: one configuration, one phase, its statistics.
+ */
+void write_sweep_row(FILE* fp, const char* engine, int pattern, int width, int height, int threads,
+                     const char* phase, const SampleStats* stats) {
+    fprintf(fp, "%s,%s,%d,%d,%d,%s,%d,%.6f,%.6f,%.6f,%.6f,%.6f\n", engine, pattern_names[pattern], width,
+            height, threads, phase, SWEEP_RUNS, stats->median, stats->p95, stats->mean, stats->stddev, stats->min);
 }
 
-int main() {
+/**
+ * @brief Times every engine at 1..max_threads threads on every synthetic image and writes
+ *        SWEEP_FILE in long ("tidy") form: one line per engine, pattern, size, threads and phase.
+ *        Grayscale and encode do not depend on the engine, so they are timed once per image
+ *        (engine "common", 1 thread). The single-threaded engine only runs at 1 thread.
+ * @return 0 on success, 1 on failure.
+ */
+int run_sweep(int max_threads) {
+    FILE* fp = fopen(SWEEP_FILE, "w");
+    if (fp == NULL) {
+        perror("Could not open sweep file");
+        return 1;
+    }
+    fprintf(fp, "engine,pattern,width,height,threads,phase,runs,median_sec,p95_sec,mean_sec,stddev_sec,min_sec\n");
+
+    printf("--- Parameter Sweep ---\n");
+    printf("Sizes: %d, patterns: %d, engines: %d, threads: 1-%d, %d timed run(s) each\n",
+           NUM_SWEEP_SIZES, NUM_PATTERNS, NUM_ENGINES, max_threads, SWEEP_RUNS);
+    printf("Saving results to: %s\n", SWEEP_FILE);
+    printf("-----------------------\n");
+
+    const GrayscaleKernel* gray_kernel = find_grayscale_kernel("auto");
+    PngWriteOptions write_options = PNG_WRITE_DEFAULTS;
+    double samples[SWEEP_RUNS];
+
+    for (int size = 0; size < NUM_SWEEP_SIZES; size++) {
+        int width = sweep_sizes[size].width;
+        int height = sweep_sizes[size].height;
+        for (int pattern = 0; pattern < NUM_PATTERNS; pattern++) {
+            ImageBuffer* rgba = make_synthetic_image(pattern, width, height);
+            ImageBuffer* grayscale = create_image_buffer(width, height, 1);
+            ImageBuffer* dithered = create_image_buffer(width, height, 1);
+            if (!grayscale || !dithered) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                exit(1);
+            }
+            printf("  %dx%d %s\n", width, height, pattern_names[pattern]);
+
+            // Engine-independent phases
+            for (int i = 0; i < SWEEP_WARMUP_RUNS + SWEEP_RUNS; i++) {
+                double start_time = omp_get_wtime();
+                for (int y = 0; y < height; y++) {
+                    gray_kernel->convert(image_row(rgba, y), image_row(grayscale, y), width);
+                }
+                if (i >= SWEEP_WARMUP_RUNS) samples[i - SWEEP_WARMUP_RUNS] = omp_get_wtime() - start_time;
+            }
+            SampleStats stats = compute_stats(samples, SWEEP_RUNS);
+            write_sweep_row(fp, "common", pattern, width, height, 1, phase_names[PHASE_GRAYSCALE], &stats);
+
+            run_engine(ENGINE_ST, 1, grayscale, dithered);
+            for (int i = 0; i < SWEEP_WARMUP_RUNS + SWEEP_RUNS; i++) {
+                double start_time = omp_get_wtime();
+                if (write_png_file(OUTPUT_FILE, dithered, &write_options) != 0) {
+                    fprintf(stderr, "Error: Could not write %s\n", OUTPUT_FILE);
+                    free_image_buffer(rgba);
+                    free_image_buffer(grayscale);
+                    free_image_buffer(dithered);
+                    fclose(fp);
+                    return 1;
+                }
+                if (i >= SWEEP_WARMUP_RUNS) samples[i - SWEEP_WARMUP_RUNS] = omp_get_wtime() - start_time;
+            }
+            stats = compute_stats(samples, SWEEP_RUNS);
+            write_sweep_row(fp, "common", pattern, width, height, 1, phase_names[PHASE_ENCODE], &stats);
+
+            for (int engine = 0; engine < NUM_ENGINES; engine++) {
+                int engine_max = (engine == ENGINE_ST) ? 1 : max_threads;
+                for (int threads = 1; threads <= engine_max; threads++) {
+                    for (int i = 0; i < SWEEP_WARMUP_RUNS + SWEEP_RUNS; i++) {
+                        double start_time = omp_get_wtime();
+                        run_engine(engine, threads, grayscale, dithered);
+                        if (i >= SWEEP_WARMUP_RUNS) samples[i - SWEEP_WARMUP_RUNS] = omp_get_wtime() - start_time;
+                    }
+                    stats = compute_stats(samples, SWEEP_RUNS);
+                    write_sweep_row(fp, engine_names[engine], pattern, width, height, threads,
+                                    phase_names[PHASE_DITHER], &stats);
+                    printf("    %-8s %2d thread(s): dither median %.4f s  p95 %.4f s\n",
+                           engine_names[engine], threads, stats.median, stats.p95);
+                }
+            }
+            fflush(fp);
+
+            free_image_buffer(rgba);
+            free_image_buffer(grayscale);
+            free_image_buffer(dithered);
+        }
+    }
+
+    fclose(fp);
+    printf("Sweep complete. Data saved to %s (plot with: python3 plot.py --sweep).\n", SWEEP_FILE);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
     FILE *fp;
-    
+
+    // ./analysis --sweep [max_threads]: synthetic images, every engine, 1..nproc threads
+    if (argc > 1 && strcmp(argv[1], "--sweep") == 0) {
+        int sweep_threads = (argc > 2) ? atoi(argv[2]) : online_cpus();
+        return run_sweep(sweep_threads > 0 ? sweep_threads : 1);
+    }
+
+    const char* input_file = (argc > 1) ? argv[1] : INPUT_FILE;
+    int max_threads = (argc > 2) ? atoi(argv[2]) : MAX_THREADS;
+    if (max_threads < 1) max_threads = 1;
+
     printf("--- Performance Analysis Tool ---\n");
-    printf("Target executable: %s\n", EXECUTABLE_NAME);
-    printf("Input file: %s\n", INPUT_FILE);
+    printf("Engines: linked in-process (single-threaded, then MT default scheduler)\n");
+    printf("Input file: %s\n", input_file);
     printf("Saving results to: %s\n", RESULT_FILE);
     printf("---------------------------------\n");
 
@@ -62,40 +411,68 @@ int main() {
         return 1;
     }
 
-    // Write CSV header
-    fprintf(fp, "Threads,Average_Time_sec,Speedup\n");
+    // Counters are optional: without any perf_event_open support only the timings are written
+    FILE* counter_fp = NULL;
+    PerfCounters probe;
+    if (perf_counters_open(&probe) > 0) {
+        counter_fp = fopen(COUNTER_FILE, "w");
+        if (counter_fp == NULL) {
+            perror("Could not open counter file");
+            fclose(fp);
+            return 1;
+        }
+        fprintf(counter_fp, "Threads,Phase,Thread");
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++) fprintf(counter_fp, ",%s", perf_counter_names[i]);
+        fprintf(counter_fp, "\n");
+        printf("Saving counters to: %s\n", COUNTER_FILE);
+    } else {
+        printf("No performance counters available; %s is not written.\n", COUNTER_FILE);
+    }
+    perf_counters_close(&probe);
+
+    // Write CSV header. Average_Time_sec, Speedup and the spread columns describe the dither
+    // phase, which is what the thread count changes; the other phases are given as medians.
+    fprintf(fp, "Threads,Average_Time_sec,Speedup,Median_sec,P95_sec,Stddev_sec,"
+                "Decode_sec,Grayscale_sec,Encode_sec\n");
 
     double baseline_time = 0.0;
 
-    // 2. Loop from 1 to MAX_THREADS
-    for (int threads = 1; threads <= MAX_THREADS; threads++) {
-        double avg_time = run_dither_and_time(threads);
-
-        if (avg_time < 0) {
-            // Error occurred during run_dither_and_time
+    // 2. Loop from 1 to max_threads
+    for (int threads = 1; threads <= max_threads; threads++) {
+        SampleStats stats[NUM_PHASES];
+        if (run_dither_and_time(input_file, threads, stats, counter_fp) != 0) {
             fclose(fp);
+            if (counter_fp) fclose(counter_fp);
             return 1;
         }
+        SampleStats dither = stats[PHASE_DITHER];
 
-        // Set the baseline time (sequential run)
+        // Set the baseline time (sequential run); medians resist outliers better than means
         if (threads == 1) {
-            baseline_time = avg_time;
-            printf("  Baseline (1 thread) time: %.4f seconds\n", baseline_time);
+            baseline_time = dither.median;
+            printf("  Baseline (1 thread) dither time: %.4f seconds (median)\n", baseline_time);
         }
 
         // Calculate Speedup (Time_sequential / Time_parallel)
-        double speedup = baseline_time / avg_time;
+        double speedup = baseline_time / dither.median;
 
-        printf("  Result: Time = %.4f s, Speedup = %.2fx\n\n", avg_time, speedup);
+        for (int phase = 0; phase < NUM_PHASES; phase++) {
+            printf("    %-9s median %.4f s  p95 %.4f s  mean %.4f s  stddev %.4f s  min %.4f s\n",
+                   phase_names[phase], stats[phase].median, stats[phase].p95, stats[phase].mean,
+                   stats[phase].stddev, stats[phase].min);
+        }
+        printf("  Result: Dither = %.4f s (median), Speedup = %.2fx\n\n", dither.median, speedup);
 
         // Write data to CSV file
-        fprintf(fp, "%d,%.6f,%.6f\n", threads, avg_time, speedup);
+        fprintf(fp, "%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n", threads, dither.mean, speedup,
+                dither.median, dither.p95, dither.stddev, stats[PHASE_DECODE].median,
+                stats[PHASE_GRAYSCALE].median, stats[PHASE_ENCODE].median);
     }
 
     // 3. Close file and finish
     fclose(fp);
+    if (counter_fp) fclose(counter_fp);
     printf("Analysis complete. Data saved to %s.\n", RESULT_FILE);
 
     return 0;
 }
-
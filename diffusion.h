@@ -0,0 +1,316 @@
+/*
+ * Error-distribution kernels shared by thread.c and error_diffusion.c.
+ *
+ * Every share of the quantization error must equal floor_divide(err * weight, 16), the
+ * Python-compatible floor division each program defines. The divisor is a power of two, and
+ * an arithmetic right shift already rounds toward negative infinity, so (err * weight) >> 4
+ * is that value without the sign branch and the hardware divide. GCC and Clang shift signed
+ * ints arithmetically; bench_error_kernels() re-checks the equivalence before timing.
+ *
+ * The Floyd-Steinberg, Jarvis-Judice-Ninke, Stucki, Atkinson and Sierra matrices are
+ * compile-time constant tap lists. The generic row kernels are always inlined into one small
+ * wrapper per matrix (stamped out with DIFFUSION_MATRIX_LIST), so each wrapper is the tap loop
+ * fully unrolled with constant weights and divisor. Every share is floor_divide(err * weight,
+ * divisor), exactly as above for 16.
+ *
+ * A table-driven variant (one 511-entry table per weight, indexed by the error) is kept in
+ * the benchmark for comparison on other CPUs. It measured slightly slower than the shift
+ * here, since the shift is one cycle and the table adds a dependent load.
+ */
+#ifndef DIFFUSION_H
+#define DIFFUSION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Defined by each program; the reference every share must match
+int floor_divide(int numerator, int denominator);
+
+// floor(err * weight / divisor), i.e. floor_divide(err * weight, divisor). Called with a
+// constant divisor, the branches fold away: powers of two become the shift described above,
+// other divisors the compiler's multiply-by-reciprocal plus a sign fix-up.
+static inline int diffusion_share(int err, int weight, int divisor) {
+    int numerator = err * weight;
+    if ((divisor & (divisor - 1)) == 0) {
+        return numerator >> __builtin_ctz(divisor);
+    }
+    int quotient = numerator / divisor;
+    return quotient - (numerator % divisor < 0);
+}
+
+// floor(err * weight / 16) for the Floyd-Steinberg weights 7, 3, 5 and 1
+static inline int fs_share(int err, int weight) {
+    return diffusion_share(err, weight, 16);
+}
+
+// ------------------------- Diffusion matrices -------------------------
+
+// The error of pixel (x, y) flows to (x + dx, y + dy) with weight / divisor
+typedef struct {
+    int dx;
+    int dy;
+    int weight;
+} DiffusionTap;
+
+#define DIFFUSION_MAX_TAPS 12
+// Deepest matrix reaches two rows below the current one
+#define DIFFUSION_MAX_DY 2
+
+typedef struct {
+    const char* name;
+    int divisor;
+    int num_taps;
+    DiffusionTap taps[DIFFUSION_MAX_TAPS];
+} DiffusionMatrix;
+
+static const DiffusionMatrix floyd_steinberg_matrix = {
+    "floyd-steinberg", 16, 4,
+    {{1, 0, 7},
+     {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}}
+};
+
+static const DiffusionMatrix jarvis_matrix = {
+    "jarvis", 48, 12,
+    {{1, 0, 7}, {2, 0, 5},
+     {-2, 1, 3}, {-1, 1, 5}, {0, 1, 7}, {1, 1, 5}, {2, 1, 3},
+     {-2, 2, 1}, {-1, 2, 3}, {0, 2, 5}, {1, 2, 3}, {2, 2, 1}}
+};
+
+static const DiffusionMatrix stucki_matrix = {
+    "stucki", 42, 12,
+    {{1, 0, 8}, {2, 0, 4},
+     {-2, 1, 2}, {-1, 1, 4}, {0, 1, 8}, {1, 1, 4}, {2, 1, 2},
+     {-2, 2, 1}, {-1, 2, 2}, {0, 2, 4}, {1, 2, 2}, {2, 2, 1}}
+};
+
+// Atkinson only passes on 6/8 of the error
+static const DiffusionMatrix atkinson_matrix = {
+    "atkinson", 8, 6,
+    {{1, 0, 1}, {2, 0, 1},
+     {-1, 1, 1}, {0, 1, 1}, {1, 1, 1},
+     {0, 2, 1}}
+};
+
+static const DiffusionMatrix sierra_matrix = {
+    "sierra", 32, 10,
+    {{1, 0, 5}, {2, 0, 3},
+     {-2, 1, 2}, {-1, 1, 4}, {0, 1, 5}, {1, 1, 4}, {2, 1, 2},
+     {-1, 2, 2}, {0, 2, 3}, {1, 2, 2}}
+};
+
+// X-macro over every matrix above; each program stamps out its specialized kernels with it
+#define DIFFUSION_MATRIX_LIST(X) \
+    X(floyd_steinberg)            \
+    X(jarvis)                     \
+    X(stucki)                     \
+    X(atkinson)                   \
+    X(sierra)
+
+// Number of rows below the current one that receive error
+static inline __attribute__((always_inline)) int diffusion_depth(const DiffusionMatrix* m) {
+    int depth = 0;
+#pragma GCC unroll 16
+    for (int i = 0; i < m->num_taps; i++) {
+        if (m->taps[i].dy > depth) depth = m->taps[i].dy;
+    }
+    return depth;
+}
+
+// Columns the row above must be ahead of x before pixel (x, y) can be computed in pull form.
+// A row only advances once its own row above is `lag` columns ahead, so row y - dy is then
+// at least dy * (lag - 1) + 1 columns past x, and a tap needs x - dx + 1 of them:
+// lag >= 1 + ceil(-dx / dy). Floyd-Steinberg gives 2, the 5-wide matrices 3.
+static inline __attribute__((always_inline)) int diffusion_lag(const DiffusionMatrix* m) {
+    int lag = 1;
+#pragma GCC unroll 16
+    for (int i = 0; i < m->num_taps; i++) {
+        const DiffusionTap* t = &m->taps[i];
+        if (t->dy > 0 && t->dx < 0) {
+            int needed = 1 + (-t->dx + t->dy - 1) / t->dy;
+            if (needed > lag) lag = needed;
+        }
+    }
+    return lag;
+}
+
+// Push form of one row, used by the single-threaded engines. rows[0] holds the accumulated
+// values of the current row, rows[dy] the row dy below it (NULL past the last image row).
+// direction is 1 for a left-to-right row and -1 for a right-to-left (serpentine) row, which
+// also mirrors the matrix horizontally. Taps that fall outside the image are dropped, like
+// the edge checks of the original loop. Always inlined with a constant matrix and direction,
+// so the tap loop is unrolled with constant weights and offsets.
+static inline __attribute__((always_inline)) void diffusion_push_row(const DiffusionMatrix* m, int direction,
+                                                                     int* const* rows, unsigned char* out,
+                                                                     int width) {
+    int* current = rows[0];
+
+    for (int i = 0; i < width; i++) {
+        int x = (direction > 0) ? i : width - 1 - i;
+        int old_pixel = current[x];
+        int new_pixel = (old_pixel > 128) ? 255 : 0;
+        out[x] = (unsigned char)new_pixel;
+        int err = old_pixel - new_pixel;
+
+#pragma GCC unroll 16
+        for (int i = 0; i < m->num_taps; i++) {
+            const DiffusionTap* t = &m->taps[i];
+            int* row = rows[t->dy];
+            int tx = x + direction * t->dx;
+            if (row && tx >= 0 && tx < width) {
+                row[tx] += diffusion_share(err, t->weight, m->divisor);
+            }
+        }
+    }
+}
+
+typedef void (*DiffusionPushRowFn)(int* const* rows, unsigned char* out, int width);
+
+#define DEFINE_DIFFUSION_PUSH_ROW(id)                                                       \
+    static void id##_push_row(int* const* rows, unsigned char* out, int width) {           \
+        diffusion_push_row(&id##_matrix, 1, rows, out, width);                             \
+    }                                                                                      \
+    static void id##_push_row_reverse(int* const* rows, unsigned char* out, int width) {   \
+        diffusion_push_row(&id##_matrix, -1, rows, out, width);                            \
+    }
+DIFFUSION_MATRIX_LIST(DEFINE_DIFFUSION_PUSH_ROW)
+
+typedef struct {
+    const DiffusionMatrix* matrix;
+    DiffusionPushRowFn push_row;          // left to right
+    DiffusionPushRowFn push_row_reverse;  // right to left, mirrored matrix
+} DiffusionKernel;
+
+#define DIFFUSION_KERNEL_ENTRY(id) {&id##_matrix, id##_push_row, id##_push_row_reverse},
+static const DiffusionKernel diffusion_kernels[] = {
+    DIFFUSION_MATRIX_LIST(DIFFUSION_KERNEL_ENTRY)
+    {NULL, NULL, NULL}
+};
+
+// Find a kernel by matrix name. Returns NULL if unknown.
+static inline const DiffusionKernel* find_diffusion_kernel(const char* name) {
+    for (const DiffusionKernel* k = diffusion_kernels; k->matrix; k++) {
+        if (strcmp(name, k->matrix->name) == 0) return k;
+    }
+    return NULL;
+}
+
+// ------------------------- Kernel microbenchmark -------------------------
+
+// Quantization errors stay within [-128, 128]; the tables cover every difference of two
+// bytes, [-255, 255], so any value that could reach them is in range.
+#define FS_ERROR_LIMIT 255
+
+static signed char fs_share_table[8][2 * FS_ERROR_LIMIT + 1];
+
+static inline void init_fs_share_table(void) {
+    for (int weight = 1; weight < 8; weight += 2) {
+        for (int err = -FS_ERROR_LIMIT; err <= FS_ERROR_LIMIT; err++) {
+            fs_share_table[weight][err + FS_ERROR_LIMIT] = (signed char)fs_share(err, weight);
+        }
+    }
+}
+
+#define FS_SHARE_FLOOR_DIVIDE(err, weight) floor_divide((err) * (weight), 16)
+#define FS_SHARE_SHIFT(err, weight) fs_share(err, weight)
+#define FS_SHARE_TABLE(err, weight) fs_share_table[weight][(err) + FS_ERROR_LIMIT]
+
+// One pull-form Floyd-Steinberg row (as in thread.c's dither_pixel) per share implementation.
+// `above` is the error row of the previous image row, or NULL for the first row.
+#define DEFINE_FS_BENCH_ROW(name, SHARE)                                                       \
+    static void name(const unsigned char* in, unsigned char* out, int* error,                 \
+                     const int* above, int width) {                                            \
+        for (int x = 0; x < width; x++) {                                                      \
+            int value = in[x];                                                                 \
+            if (x > 0) value += SHARE(error[x - 1], 7);                                        \
+            if (above) {                                                                       \
+                if (x + 1 < width) value += SHARE(above[x + 1], 3);                            \
+                value += SHARE(above[x], 5);                                                   \
+                if (x > 0) value += SHARE(above[x - 1], 1);                                    \
+            }                                                                                  \
+            int new_pixel = (value > 128) ? 255 : 0;                                           \
+            out[x] = (unsigned char)new_pixel;                                                 \
+            error[x] = value - new_pixel;                                                      \
+        }                                                                                      \
+    }
+
+DEFINE_FS_BENCH_ROW(fs_bench_row_floor_divide, FS_SHARE_FLOOR_DIVIDE)
+DEFINE_FS_BENCH_ROW(fs_bench_row_shift, FS_SHARE_SHIFT)
+DEFINE_FS_BENCH_ROW(fs_bench_row_table, FS_SHARE_TABLE)
+
+typedef void (*FsBenchRowFn)(const unsigned char* in, unsigned char* out, int* error,
+                             const int* above, int width);
+
+static inline double fs_bench_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --bench-kernel: dither a width x height plane of random gray values with each share
+// implementation (best of `runs`), print ns/pixel and check that the outputs are identical.
+// Returns 0 if every variant matches floor_divide.
+static inline int bench_error_kernels(int width, int height, int runs) {
+    static const struct {
+        const char* name;
+        FsBenchRowFn row;
+    } variants[] = {
+        {"floor_divide", fs_bench_row_floor_divide},
+        {"shift", fs_bench_row_shift},
+        {"table", fs_bench_row_table},
+    };
+    enum { VARIANTS = sizeof(variants) / sizeof(variants[0]) };
+    size_t pixels = (size_t)width * height;
+
+    // The shift must agree with floor_divide for every error a table can hold
+    int failed = 0;
+    for (int err = -FS_ERROR_LIMIT; err <= FS_ERROR_LIMIT; err++) {
+        for (int weight = 1; weight < 8; weight += 2) {
+            if (fs_share(err, weight) != floor_divide(err * weight, 16)) failed = 1;
+        }
+    }
+    init_fs_share_table();
+
+    unsigned char* input = (unsigned char*)malloc(pixels);
+    unsigned char* reference = (unsigned char*)malloc(pixels);
+    unsigned char* output = (unsigned char*)malloc(pixels);
+    int* error = (int*)malloc(pixels * sizeof(int));
+    if (!input || !reference || !output || !error) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    srand(1);
+    for (size_t i = 0; i < pixels; i++) {
+        input[i] = (unsigned char)(rand() & 0xFF);
+    }
+
+    printf("Error kernel benchmark, %dx%d random pixels, best of %d:\n", width, height, runs);
+    for (int v = 0; v < VARIANTS; v++) {
+        unsigned char* out = (v == 0) ? reference : output;
+        double best = 0.0;
+
+        for (int run = 0; run < runs; run++) {
+            double start = fs_bench_seconds();
+            for (int y = 0; y < height; y++) {
+                variants[v].row(input + (size_t)y * width, out + (size_t)y * width, error + (size_t)y * width,
+                                y ? error + (size_t)(y - 1) * width : NULL, width);
+            }
+            double elapsed = fs_bench_seconds() - start;
+            if (run == 0 || elapsed < best) best = elapsed;
+        }
+
+        int same = (v == 0) || memcmp(reference, output, pixels) == 0;
+        if (!same) failed = 1;
+        printf("  %-12s %6.2f ns/pixel%s\n", variants[v].name, best * 1e9 / pixels,
+               same ? "" : "  OUTPUT DIFFERS");
+    }
+
+    free(input);
+    free(reference);
+    free(output);
+    free(error);
+    return failed;
+}
+
+#endif // DIFFUSION_H
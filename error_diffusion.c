@@ -1,17 +1,119 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <png.h>
+#include <zlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "grayscale.h"
+#include "diffusion.h"
+#include "perfcount.h"
+#include "netpbm.h"
+
+// Row starts are aligned to this many bytes
+#define IMAGE_ALIGNMENT 64
+
+// One contiguous, aligned allocation per image plane; row y starts at data + y * stride
+typedef struct {
+    int width;
+    int height;
+    size_t stride;
+    unsigned char* data;
+} ImageBuffer;
 
 typedef struct {
     int width;
     int height;
     png_byte color_type;
     png_byte bit_depth;
-    png_bytep *row_pointers;
+    ImageBuffer *pixels;    // RGBA, 4 bytes per pixel
 } PngImage;
 
+// How write_png_file encodes the dithered plane (-1 leaves the libpng default)
+typedef struct {
+    int bit_depth;          // 8: one byte per pixel (0/255), 1: bit-packed bilevel
+    int compression_level;  // zlib level 0-9
+    int filters;            // PNG_FILTER_* mask; the default lets libpng pick per row
+    int strategy;           // zlib strategy (Z_FILTERED, Z_RLE, ...)
+} PngWriteOptions;
+
+#define PNG_WRITE_DEFAULTS { 8, -1, -1, -1 }
+
+// Name/value pairs for command-line choices
+typedef struct {
+    const char* name;
+    int value;
+} NamedValue;
+
+static const NamedValue png_filter_names[] = {
+    {"none", PNG_FILTER_NONE}, {"sub", PNG_FILTER_SUB}, {"up", PNG_FILTER_UP},
+    {"avg", PNG_FILTER_AVG}, {"paeth", PNG_FILTER_PAETH}, {"all", PNG_ALL_FILTERS},
+    {NULL, 0}
+};
+
+static const NamedValue zlib_strategy_names[] = {
+    {"default", Z_DEFAULT_STRATEGY}, {"filtered", Z_FILTERED}, {"huffman", Z_HUFFMAN_ONLY},
+    {"rle", Z_RLE}, {"fixed", Z_FIXED},
+    {NULL, 0}
+};
+
+ImageBuffer* create_image_buffer(int width, int height, size_t bytes_per_pixel) {
+    ImageBuffer *buffer = (ImageBuffer*)malloc(sizeof(ImageBuffer));
+    if (!buffer) return NULL;
+
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = (width * bytes_per_pixel + IMAGE_ALIGNMENT - 1) & ~(size_t)(IMAGE_ALIGNMENT - 1);
+    if (posix_memalign((void**)&buffer->data, IMAGE_ALIGNMENT, buffer->stride * height) != 0) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+void free_image_buffer(ImageBuffer *buffer) {
+    if (buffer) {
+        free(buffer->data);
+        free(buffer);
+    }
+}
+
+static inline unsigned char* image_row(const ImageBuffer *buffer, int y) {
+    return buffer->data + (size_t)y * buffer->stride;
+}
+
+// Ask libpng to deliver 8-bit RGBA rows whatever the source format is
+void set_rgba_transforms(png_structp png, png_infop info) {
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth = png_get_bit_depth(png, info);
+
+    if (bit_depth == 16) png_set_strip_16(png);
+    if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
+    
+    if (color_type == PNG_COLOR_TYPE_RGB ||
+        color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+
+    if (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png);
+
+    png_read_update_info(png, info);
+}
+
+void free_png_image(PngImage *image) {
+    if (image) {
+        free_image_buffer(image->pixels);
+        free(image);
+    }
+}
+
 PngImage* read_png_file(const char* filename) {
     FILE *fp = fopen(filename, "rb");
     if (!fp) return NULL;
@@ -29,7 +131,13 @@ PngImage* read_png_file(const char* filename) {
         return NULL;
     }
 
+    // Allocated after setjmp, so volatile: a longjmp on a corrupt file must still free them
+    PngImage* volatile image = NULL;
+    png_bytep* volatile row_pointers = NULL;
+
     if (setjmp(png_jmpbuf(png))) {
+        free(row_pointers);
+        free_png_image(image);
         png_destroy_read_struct(&png, &info, NULL);
         fclose(fp);
         return NULL;
@@ -38,50 +146,31 @@ PngImage* read_png_file(const char* filename) {
     png_init_io(png, fp);
     png_read_info(png, info);
 
-    PngImage *image = (PngImage*)malloc(sizeof(PngImage));
+    image = (PngImage*)calloc(1, sizeof(PngImage));
+    if (!image) longjmp(png_jmpbuf(png), 1);
     image->width = png_get_image_width(png, info);
     image->height = png_get_image_height(png, info);
     image->color_type = png_get_color_type(png, info);
     image->bit_depth = png_get_bit_depth(png, info);
 
-    if (image->bit_depth == 16) png_set_strip_16(png);
-    if (image->color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
-    if (image->color_type == PNG_COLOR_TYPE_GRAY && image->bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png);
-    if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
-    
-    if (image->color_type == PNG_COLOR_TYPE_RGB ||
-        image->color_type == PNG_COLOR_TYPE_GRAY ||
-        image->color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
-
-    if (image->color_type == PNG_COLOR_TYPE_GRAY ||
-        image->color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-        png_set_gray_to_rgb(png);
+    set_rgba_transforms(png, info);
 
-    png_read_update_info(png, info);
-
-    image->row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * image->height);
+    // Decode straight into one flat RGBA buffer; libpng only needs a temporary index of row starts
+    image->pixels = create_image_buffer(image->width, image->height, 4);
+    row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * image->height);
+    if (!image->pixels || !row_pointers) longjmp(png_jmpbuf(png), 1);
     for (int y = 0; y < image->height; y++) {
-        image->row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png, info));
+        row_pointers[y] = image_row(image->pixels, y);
     }
 
-    png_read_image(png, image->row_pointers);
+    png_read_image(png, row_pointers);
+    free(row_pointers);
     png_destroy_read_struct(&png, &info, NULL);
     fclose(fp);
 
     return image;
 }
 
-void free_png_image(PngImage *image) {
-    if (image) {
-        for (int y = 0; y < image->height; y++) {
-            free(image->row_pointers[y]);
-        }
-        free(image->row_pointers);
-        free(image);
-    }
-}
-
 // don't change this function (rgb_to_grayscale)
 unsigned char rgb_to_grayscale(unsigned char r, unsigned char g, unsigned char b) {
     unsigned char result = (unsigned char)((0.2989 * r + 0.587 * g + 0.114 * b));
@@ -91,54 +180,100 @@ unsigned char rgb_to_grayscale(unsigned char r, unsigned char g, unsigned char b
     return result;
 }
 
-void write_png_file(const char* filename, unsigned char** data, int width, int height) {
+// Look up a command-line name; returns -1 if it is not in the table
+int lookup_named_value(const NamedValue* table, const char* name) {
+    for (; table->name; table++) {
+        if (strcmp(table->name, name) == 0) return table->value;
+    }
+    return -1;
+}
+
+// Compression settings shared by every PNG writer
+void apply_png_write_options(png_structp png, const PngWriteOptions* options) {
+    if (options->compression_level >= 0) png_set_compression_level(png, options->compression_level);
+    if (options->filters >= 0) png_set_filter(png, PNG_FILTER_TYPE_BASE, options->filters);
+    if (options->strategy >= 0) png_set_compression_strategy(png, options->strategy);
+}
+
+// Pack a dithered row (every pixel 0 or 255) into 1 bit per pixel, most significant bit first.
+// Because pixels are 0 or 255, masking each byte with its bit position yields the packed bit.
+void pack_row_1bit(const unsigned char* row, png_bytep packed, int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const unsigned char* p = row + x;
+        *packed++ = (p[0] & 0x80) | (p[1] & 0x40) | (p[2] & 0x20) | (p[3] & 0x10) |
+                    (p[4] & 0x08) | (p[5] & 0x04) | (p[6] & 0x02) | (p[7] & 0x01);
+    }
+    if (x < width) {
+        png_byte tail = 0;
+        for (int bit = 0; x < width; x++, bit++) {
+            tail |= (row[x] & 0x80) >> bit;
+        }
+        *packed = tail;
+    }
+}
+
+// Returns 0 on success, -1 if the file could not be created or encoded
+int write_png_file(const char* filename, const ImageBuffer* data, const PngWriteOptions* options) {
+    int width = data->width;
+    int height = data->height;
+
     FILE *fp = fopen(filename, "wb");
-    if (!fp) return;
+    if (!fp) return -1;
+
+    png_bytep packed = (options->bit_depth == 1) ? (png_bytep)malloc((width + 7) / 8) : NULL;
+    if (options->bit_depth == 1 && !packed) {
+        fclose(fp);
+        return -1;
+    }
 
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png) {
+        free(packed);
         fclose(fp);
-        return;
+        return -1;
     }
 
     png_infop info = png_create_info_struct(png);
     if (!info) {
         png_destroy_write_struct(&png, NULL);
+        free(packed);
         fclose(fp);
-        return;
+        return -1;
     }
 
     if (setjmp(png_jmpbuf(png))) {
         png_destroy_write_struct(&png, &info);
+        free(packed);
         fclose(fp);
-        return;
+        return -1;
     }
 
     png_init_io(png, fp);
-    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_GRAY, 
+    png_set_IHDR(png, info, width, height, options->bit_depth, PNG_COLOR_TYPE_GRAY, 
                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    apply_png_write_options(png, options);
     png_write_info(png, info);
 
-    png_bytep* row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
+    // 8-bit rows are encoded in place, no copy; 1-bit rows are packed into one scratch row
     for (int y = 0; y < height; y++) {
-        row_pointers[y] = (png_byte*)malloc(width);
-        for (int x = 0; x < width; x++) {
-            row_pointers[y][x] = data[y][x];
+        if (packed) {
+            pack_row_1bit(image_row(data, y), packed, width);
+            png_write_row(png, packed);
+        } else {
+            png_write_row(png, image_row(data, y));
         }
     }
-
-    png_write_image(png, row_pointers);
     png_write_end(png, NULL);
 
-    for (int y = 0; y < height; y++) {
-        free(row_pointers[y]);
-    }
-    free(row_pointers);
+    free(packed);
     png_destroy_write_struct(&png, &info);
     fclose(fp);
+    return 0;
 }
 
-// Custom floor division function to match Python's //
+// Custom floor division function to match Python's //. The dithering loops use the
+// equivalent fs_share() from diffusion.h; this stays as its reference.
 int floor_divide(int numerator, int denominator) {
     if (numerator >= 0) {
         return numerator / denominator;
@@ -148,102 +283,507 @@ int floor_divide(int numerator, int denominator) {
     }
 }
 
-void dither_image(unsigned char** input, unsigned char** output, int width, int height) {
+// Whole-image dithering; with serpentine set, odd rows run right to left with the mirrored matrix
+void dither_image(const ImageBuffer* input, ImageBuffer* output, const DiffusionKernel* kernel, int serpentine) {
+    int width = input->width;
+    int height = input->height;
+
     // Create working array
-    int** work = (int**)malloc(height * sizeof(int*));
+    ImageBuffer* work = create_image_buffer(width, height, sizeof(int));
+    if (!work) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
     for (int y = 0; y < height; y++) {
-        work[y] = (int*)malloc(width * sizeof(int));
+        const unsigned char* in = image_row(input, y);
+        int* w = (int*)image_row(work, y);
         for (int x = 0; x < width; x++) {
-            work[y][x] = input[y][x];
+            w[x] = in[x];
         }
     }
 
-    // Floyd-Steinberg dithering with Python-compatible floor division
+    // Error diffusion with Python-compatible floor division, specialized per matrix
     for (int y = 0; y < height; y++) {
+        // The current row and the rows below it that receive error
+        int* rows[DIFFUSION_MAX_DY + 1];
+        for (int dy = 0; dy <= DIFFUSION_MAX_DY; dy++) {
+            rows[dy] = (y + dy < height) ? (int*)image_row(work, y + dy) : NULL;
+        }
+        if (serpentine && y % 2 == 1) {
+            kernel->push_row_reverse(rows, image_row(output, y), width);
+        } else {
+            kernel->push_row(rows, image_row(output, y), width);
+        }
+    }
+
+    free_image_buffer(work);
+}
+
+// Two padded rows of accumulated error, rotated after every image row
+typedef struct {
+    int width;
+    int16_t* storage;
+    int16_t* current;
+    int16_t* below;
+} ErrorRows;
+
+int init_error_rows(ErrorRows* rows, int width) {
+    rows->width = width;
+    rows->storage = (int16_t*)calloc(2 * (size_t)(width + 2), sizeof(int16_t));
+    if (!rows->storage) return -1;
+    rows->current = rows->storage + 1;
+    rows->below = rows->storage + (width + 2) + 1;
+    return 0;
+}
+
+void free_error_rows(ErrorRows* rows) {
+    free(rows->storage);
+}
+
+// Dither one row against the rolling error rows, then rotate them for the next row.
+// A reversed (serpentine) row runs right to left with the mirrored weights.
+void dither_row_low_memory(const unsigned char* in, unsigned char* out, ErrorRows* rows, int reverse) {
+    int width = rows->width;
+    int16_t* current = rows->current;
+    int16_t* below = rows->below;
+
+    if (!reverse) {
         for (int x = 0; x < width; x++) {
-            int old_pixel = work[y][x];
+            int old_pixel = in[x] + current[x];
             int new_pixel = (old_pixel > 128) ? 255 : 0;
-            output[y][x] = (unsigned char)new_pixel;
+            out[x] = (unsigned char)new_pixel;
             int err = old_pixel - new_pixel;
 
-            // Use floor division to match Python's //
-            if (x + 1 < width) 
-                work[y][x + 1] += floor_divide(err * 7, 16);
-            if (y + 1 < height) {
-                if (x - 1 >= 0) 
-                    work[y + 1][x - 1] += floor_divide(err * 3, 16);
-                work[y + 1][x] += floor_divide(err * 5, 16);
-                if (x + 1 < width) 
-                    work[y + 1][x + 1] += floor_divide(err * 1, 16);
-            }
+            current[x + 1] += fs_share(err, 7);
+            below[x - 1] += fs_share(err, 3);
+            below[x] += fs_share(err, 5);
+            below[x + 1] += fs_share(err, 1);
         }
+    } else {
+        for (int x = width - 1; x >= 0; x--) {
+            int old_pixel = in[x] + current[x];
+            int new_pixel = (old_pixel > 128) ? 255 : 0;
+            out[x] = (unsigned char)new_pixel;
+            int err = old_pixel - new_pixel;
+
+            current[x - 1] += fs_share(err, 7);
+            below[x + 1] += fs_share(err, 3);
+            below[x] += fs_share(err, 5);
+            below[x - 1] += fs_share(err, 1);
+        }
+    }
+
+    // The next row becomes current; the old current row is recycled as a cleared next row
+    rows->current = below;
+    rows->below = current;
+    memset(current - 1, 0, (width + 2) * sizeof(int16_t));
+}
+
+// Low-memory Floyd-Steinberg: error only ever flows into the current and the next row, so
+// two int16 rows of accumulated error replace the full int work copy. Each row is padded by
+// one cell on both sides, which absorbs the writes past the image edges without branching.
+// Input pixels are read before the output pixel is written, so output may alias input.
+void dither_image_low_memory(const ImageBuffer* input, ImageBuffer* output, int serpentine) {
+    ErrorRows rows;
+    if (init_error_rows(&rows, input->width) != 0) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int y = 0; y < input->height; y++) {
+        dither_row_low_memory(image_row(input, y), image_row(output, y), &rows, serpentine && y % 2 == 1);
+    }
+
+    free_error_rows(&rows);
+}
+
+// Streaming pipeline: decode one row, convert it to grayscale, dither it and encode it before
+// the next row is read. Memory is O(width) regardless of the image height, and output bytes
+// are emitted while the input is still being decoded. Returns 0 on success, -1 on failure.
+int dither_png_streaming(const char* input_file, const char* output_file, const PngWriteOptions* write_options,
+                         GrayscaleRowFn convert_gray, int serpentine) {
+    FILE *in_fp = fopen(input_file, "rb");
+    if (!in_fp) return -1;
+    FILE *out_fp = fopen(output_file, "wb");
+    if (!out_fp) {
+        fclose(in_fp);
+        return -1;
     }
 
-    // Cleanup
+    png_structp in_png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop in_info = in_png ? png_create_info_struct(in_png) : NULL;
+    png_structp out_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop out_info = out_png ? png_create_info_struct(out_png) : NULL;
+
+    // The row buffers need the width from the header, so they are allocated after setjmp; they
+    // are volatile so the fail path still sees them after a longjmp
+    png_bytep volatile rgba = NULL;
+    unsigned char* volatile row = NULL;
+    png_bytep volatile packed = NULL;
+    ErrorRows* volatile rows = NULL;
+
+    if (!in_info || !out_info) goto fail;
+    if (setjmp(png_jmpbuf(in_png))) goto fail;
+    if (setjmp(png_jmpbuf(out_png))) goto fail;
+
+    png_init_io(in_png, in_fp);
+    png_read_info(in_png, in_info);
+
+    // Interlaced images deliver every row several times, so they cannot be streamed
+    if (png_get_interlace_type(in_png, in_info) != PNG_INTERLACE_NONE) {
+        printf("Error: Streaming mode does not support interlaced PNGs\n");
+        longjmp(png_jmpbuf(in_png), 1);
+    }
+
+    int width = png_get_image_width(in_png, in_info);
+    int height = png_get_image_height(in_png, in_info);
+    set_rgba_transforms(in_png, in_info);
+
+    rgba = (png_bytep)malloc(png_get_rowbytes(in_png, in_info));
+    row = (unsigned char*)malloc(width);
+    if (write_options->bit_depth == 1) {
+        packed = (png_bytep)malloc((width + 7) / 8);
+        if (!packed) longjmp(png_jmpbuf(in_png), 1);
+    }
+    rows = (ErrorRows*)calloc(1, sizeof(ErrorRows));
+    if (!rgba || !row || !rows || init_error_rows(rows, width) != 0) longjmp(png_jmpbuf(in_png), 1);
+
+    png_init_io(out_png, out_fp);
+    png_set_IHDR(out_png, out_info, width, height, write_options->bit_depth, PNG_COLOR_TYPE_GRAY,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    apply_png_write_options(out_png, write_options);
+    png_write_info(out_png, out_info);
+
     for (int y = 0; y < height; y++) {
-        free(work[y]);
+        png_read_row(in_png, rgba, NULL);
+        convert_gray(rgba, row, width);
+        // Dither in place: each input pixel is read before its output is written
+        dither_row_low_memory(row, row, rows, serpentine && y % 2 == 1);
+        if (packed) {
+            pack_row_1bit(row, packed, width);
+            png_write_row(out_png, packed);
+        } else {
+            png_write_row(out_png, row);
+        }
+    }
+
+    png_read_end(in_png, NULL);
+    png_write_end(out_png, NULL);
+
+    free_error_rows(rows);
+    free(rows);
+    free(packed);
+    free(row);
+    free(rgba);
+    png_destroy_read_struct(&in_png, &in_info, NULL);
+    png_destroy_write_struct(&out_png, &out_info);
+    fclose(in_fp);
+    fclose(out_fp);
+    return 0;
+
+fail:
+    if (rows) free_error_rows(rows);
+    free(rows);
+    free(packed);
+    free(row);
+    free(rgba);
+    png_destroy_read_struct(&in_png, &in_info, NULL);
+    png_destroy_write_struct(&out_png, &out_info);
+    fclose(in_fp);
+    fclose(out_fp);
+    // Rows already encoded would otherwise be left behind as a truncated PNG
+    unlink(output_file);
+    return -1;
+}
+
+// Grayscale plane of a mapped PGM/PBM. An 8-bit graymap is used in place through `view` (the
+// mapping is private, so nothing reaches the file); a bitmap or another maxval is converted
+// into a new plane, which the caller frees. NULL if that allocation fails.
+static ImageBuffer* pnm_input_plane(const PnmImage* map, ImageBuffer* view) {
+    if (map->format == PNM_GRAYMAP && map->maxval == 255) {
+        *view = (ImageBuffer){map->width, map->height, map->row_bytes, map->pixels};
+        return view;
+    }
+    ImageBuffer* plane = create_image_buffer(map->width, map->height, 1);
+    if (!plane) return NULL;
+    for (int y = 0; y < map->height; y++) {
+        const unsigned char* row = map->pixels + (size_t)y * map->row_bytes;
+        if (map->format == PNM_BITMAP) {
+            pnm_unpack_row(row, image_row(plane, y), map->width);
+        } else {
+            pnm_scale_row(row, image_row(plane, y), map->width, map->maxval);
+        }
     }
-    free(work);
+    return plane;
+}
+
+void print_usage(const char* program) {
+    printf("Usage: %s <input> <output> [options]\n", program);
+    printf("Input and output are PNG, or binary PGM (.pgm) / PBM (.pbm), which are read and written\n");
+    printf("through mmap without a decode or encode step.\n");
+    printf("Options:\n");
+    printf("  -M, --matrix <name>       diffusion matrix: floyd-steinberg, jarvis, stucki, atkinson or sierra\n");
+    printf("                            (default: floyd-steinberg)\n");
+    printf("  -S, --serpentine          scan odd rows right to left\n");
+    printf("  -l, --low-memory          keep two rows of error instead of a full work copy, dither in place\n");
+    printf("  -s, --stream              decode, dither and encode one row at a time (constant memory, PNG only)\n");
+    printf("  -1, --one-bit             write a bit-packed 1-bit grayscale PNG (for 1-bit PBM, name the output .pbm)\n");
+    printf("  -c, --compression <0-9>   zlib compression level\n");
+    printf("  -f, --filter <name>       PNG row filter: none, sub, up, avg, paeth or all (adaptive)\n");
+    printf("  -z, --strategy <name>     zlib strategy: default, filtered, huffman, rle or fixed\n");
+    printf("  -F, --fast                fast encode preset: level 1, no filter, rle strategy\n");
+    printf("  -g, --gray <name>         grayscale kernel: auto, avx2, sse4.1, scalar or lut (default: auto)\n");
+    printf("  -G, --check-gray          verify every grayscale kernel against rgb_to_grayscale and exit\n");
+    printf("  -K, --bench-kernel        benchmark the error-distribution kernels (ns/pixel) and exit\n");
+    printf("  -e, --perf-counters       count cycles, instructions, LLC/branch misses and context switches\n");
+    printf("                            per phase (perf_event_open)\n");
 }
+
 int main(int argc, char *argv[]) {
+    int low_memory = 0;
+    int stream = 0;
+    PngWriteOptions write_options = PNG_WRITE_DEFAULTS;
+    const GrayscaleKernel* gray_kernel = find_grayscale_kernel("auto");
+    const DiffusionKernel* kernel = &diffusion_kernels[0];
+    int serpentine = 0;
+    int perf_counters = 0;
+
+    static struct option long_options[] = {
+        {"matrix", required_argument, NULL, 'M'},
+        {"serpentine", no_argument, NULL, 'S'},
+        {"low-memory", no_argument, NULL, 'l'},
+        {"stream", no_argument, NULL, 's'},
+        {"one-bit", no_argument, NULL, '1'},
+        {"compression", required_argument, NULL, 'c'},
+        {"filter", required_argument, NULL, 'f'},
+        {"strategy", required_argument, NULL, 'z'},
+        {"fast", no_argument, NULL, 'F'},
+        {"gray", required_argument, NULL, 'g'},
+        {"check-gray", no_argument, NULL, 'G'},
+        {"bench-kernel", no_argument, NULL, 'K'},
+        {"perf-counters", no_argument, NULL, 'e'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "M:Sls1c:f:z:Fg:GKe", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'M':
+                kernel = find_diffusion_kernel(optarg);
+                if (!kernel) {
+                    printf("Error: Unknown diffusion matrix '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                serpentine = 1;
+                break;
+            case 'l':
+                low_memory = 1;
+                break;
+            case 's':
+                stream = 1;
+                break;
+            case '1':
+                write_options.bit_depth = 1;
+                break;
+            case 'c':
+                write_options.compression_level = atoi(optarg);
+                if (write_options.compression_level < 0 || write_options.compression_level > 9) {
+                    printf("Error: Compression level must be 0-9\n");
+                    return 1;
+                }
+                break;
+            case 'f':
+                write_options.filters = lookup_named_value(png_filter_names, optarg);
+                if (write_options.filters < 0) {
+                    printf("Error: Unknown filter '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'z':
+                write_options.strategy = lookup_named_value(zlib_strategy_names, optarg);
+                if (write_options.strategy < 0) {
+                    printf("Error: Unknown strategy '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                // Dithered rows are mostly runs of 0/255, which RLE matches cheaply
+                write_options.compression_level = 1;
+                write_options.filters = PNG_FILTER_NONE;
+                write_options.strategy = Z_RLE;
+                break;
+            case 'g':
+                gray_kernel = find_grayscale_kernel(optarg);
+                if (!gray_kernel) {
+                    printf("Error: Grayscale kernel '%s' is unknown or not supported on this CPU\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'G':
+                printf("Checking grayscale kernels against rgb_to_grayscale:\n");
+                return check_grayscale_kernels();
+            case 'K':
+                return bench_error_kernels(4000, 3000, 3);
+            case 'e':
+                perf_counters = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
     // Check command line arguments
-    if (argc != 3) {
-        printf("Usage: %s <input.png> <output.png>\n", argv[0]);
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
         return 1;
     }
 
-    const char* input_file = argv[1];
-    const char* image_output = argv[2];
+    const char* input_file = argv[optind];
+    const char* image_output = argv[optind + 1];
 
-    // Read PNG
-    PngImage *image = read_png_file(input_file);
-    if (!image) {
-        printf("Error: Could not read %s\n", input_file);
+    // The two-row error buffers of these modes only reach one row down
+    if ((stream || low_memory) && kernel->matrix != &floyd_steinberg_matrix) {
+        printf("Error: --low-memory and --stream only support the floyd-steinberg matrix\n");
         return 1;
     }
 
-    // Allocate arrays
-    unsigned char** grayscale = (unsigned char**)malloc(image->height * sizeof(unsigned char*));
-    unsigned char** dithered = (unsigned char**)malloc(image->height * sizeof(unsigned char*));
-    
-    if (!grayscale || !dithered) {
-        printf("Error: Memory allocation failed\n");
+    // 0 for PNG, else PNM_GRAYMAP or PNM_BITMAP
+    int input_format = pnm_format_for_path(input_file);
+    int output_format = pnm_format_for_path(image_output);
+    if (input_format && output_format && pnm_same_file(input_file, image_output)) {
+        printf("Error: A PGM/PBM input cannot be dithered onto itself\n");
         return 1;
     }
-    
-    for (int y = 0; y < image->height; y++) {
-        grayscale[y] = (unsigned char*)malloc(image->width * sizeof(unsigned char));
-        dithered[y] = (unsigned char*)malloc(image->width * sizeof(unsigned char));
-        if (!grayscale[y] || !dithered[y]) {
-            printf("Error: Memory allocation failed for row %d\n", y);
+    if (stream && (input_format || output_format)) {
+        printf("Error: --stream reads and writes PNG; PGM/PBM files are mapped instead\n");
+        return 1;
+    }
+
+    // Phases are counted separately; --stream interleaves them, so it gets one total
+    PerfCounters perf;
+    PerfSample phase_counters[NUM_PHASES];
+    if (perf_counters && perf_counters_open(&perf) == 0) {
+        printf("Warning: No performance counters available (see perf_event_paranoid)\n");
+    }
+
+    if (stream) {
+        if (perf_counters) perf_counters_start(&perf);
+        if (dither_png_streaming(input_file, image_output, &write_options, gray_kernel->convert, serpentine) != 0) {
+            printf("Error: Could not stream %s to %s\n", input_file, image_output);
             return 1;
         }
+        printf("File %s finished\n", image_output);
+        if (perf_counters) {
+            PerfSample total;
+            perf_counters_stop(&perf, &total);
+            printf("Performance counters:\n");
+            perf_sample_print_header(stdout, "phase");
+            perf_sample_print(stdout, "stream", &total);
+            perf_counters_close(&perf);
+        }
+        return 0;
     }
 
-    // Convert to grayscale
-    for (int y = 0; y < image->height; y++) {
-        png_bytep row = image->row_pointers[y];
-        for (int x = 0; x < image->width; x++) {
-            png_bytep px = &(row[x * 4]);
-            grayscale[y][x] = rgb_to_grayscale(px[0], px[1], px[2]);
+    // Read PNG, or map the PGM/PBM and parse its header
+    PngImage *image = NULL;
+    PnmImage input_map;
+    if (perf_counters) perf_counters_start(&perf);
+    if (input_format) {
+        if (pnm_map_file(input_file, &input_map) != 0) return 1;
+    } else {
+        image = read_png_file(input_file);
+    }
+    if (perf_counters) perf_counters_stop(&perf, &phase_counters[PHASE_DECODE]);
+    if (!input_format && !image) {
+        printf("Error: Could not read %s\n", input_file);
+        return 1;
+    }
+    int width = input_format ? input_map.width : image->width;
+    int height = input_format ? input_map.height : image->height;
+
+    // Convert to grayscale; an 8-bit PGM already is
+    ImageBuffer grayscale_view, dithered_view;
+    ImageBuffer* grayscale;
+    if (perf_counters) perf_counters_start(&perf);
+    if (input_format) {
+        grayscale = pnm_input_plane(&input_map, &grayscale_view);
+    } else {
+        grayscale = create_image_buffer(width, height, 1);
+        for (int y = 0; grayscale && y < height; y++) {
+            gray_kernel->convert(image_row(image->pixels, y), image_row(grayscale, y), width);
         }
     }
+    if (perf_counters) perf_counters_stop(&perf, &phase_counters[PHASE_GRAYSCALE]);
+
+    // A PGM output is dithered straight into its mapping; otherwise low-memory mode dithers the
+    // grayscale plane in place
+    PnmImage output_map;
+    ImageBuffer* dithered;
+    if (output_format == PNM_GRAYMAP) {
+        if (pnm_create_file(image_output, PNM_GRAYMAP, width, height, &output_map) != 0) return 1;
+        dithered_view = (ImageBuffer){width, height, output_map.row_bytes, output_map.pixels};
+        dithered = &dithered_view;
+    } else {
+        dithered = low_memory ? grayscale : create_image_buffer(width, height, 1);
+    }
+
+    if (!grayscale || !dithered) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
 
     // Create dithered image
-    dither_image(grayscale, dithered, image->width, image->height);
-    write_png_file(image_output, dithered, image->width, image->height);
-    
-    printf("File %s finished\n", image_output);
+    if (perf_counters) perf_counters_start(&perf);
+    if (low_memory) {
+        // The RGBA decode is no longer needed once the grayscale plane exists
+        free_png_image(image);
+        image = NULL;
+        dither_image_low_memory(grayscale, dithered, serpentine);
+    } else {
+        dither_image(grayscale, dithered, kernel, serpentine);
+    }
+    if (perf_counters) perf_counters_stop(&perf, &phase_counters[PHASE_DITHER]);
+
+    // A PGM was written by the dither itself; a PBM is packed into its mapping
+    int write_failed = 0;
+    if (perf_counters) perf_counters_start(&perf);
+    if (output_format == PNM_BITMAP) {
+        write_failed = pnm_create_file(image_output, PNM_BITMAP, width, height, &output_map) != 0;
+        for (int y = 0; !write_failed && y < height; y++) {
+            pnm_pack_row(image_row(dithered, y), output_map.pixels + (size_t)y * output_map.row_bytes, width);
+        }
+    } else if (!output_format) {
+        write_failed = write_png_file(image_output, dithered, &write_options) != 0;
+        if (write_failed) printf("Error: Could not write %s\n", image_output);
+    }
+    if (output_format) pnm_unmap(&output_map);
+    if (perf_counters) perf_counters_stop(&perf, &phase_counters[PHASE_ENCODE]);
 
-    // Cleanup
-    for (int y = 0; y < image->height; y++) {
-        free(grayscale[y]);
-        free(dithered[y]);
+    if (!write_failed) printf("File %s finished\n", image_output);
+
+    if (perf_counters) {
+        printf("Performance counters:\n");
+        perf_sample_print_header(stdout, "phase");
+        for (int phase = 0; phase < NUM_PHASES; phase++) {
+            perf_sample_print(stdout, phase_names[phase], &phase_counters[phase]);
+        }
+        perf_counters_close(&perf);
     }
-    free(grayscale);
-    free(dithered);
-    free_png_image(image);
 
-    return 0;
+    // Cleanup; the views into mappings have nothing to free
+    if (dithered != grayscale && dithered != &dithered_view) {
+        free_image_buffer(dithered);
+    }
+    if (grayscale != &grayscale_view) free_image_buffer(grayscale);
+    if (input_format) {
+        pnm_unmap(&input_map);
+    } else {
+        free_png_image(image);
+    }
+
+    return write_failed ? 1 : 0;
 
 }
@@ -0,0 +1,271 @@
+/*
+ * RGBA -> grayscale row conversion shared by thread.c and error_diffusion.c.
+ *
+ * Every kernel must produce exactly the bytes of rgb_to_grayscale(), which each program
+ * defines and which must not change. The SIMD kernels therefore repeat its double-precision
+ * arithmetic operation for operation (multiply, multiply, add, multiply, add, truncate, +1 for
+ * mid values) rather than approximating it in fixed point, and verify_grayscale_kernel()
+ * compares a kernel against the scalar function for all 16.7M RGB inputs.
+ *
+ * The SIMD kernels are compiled with per-function target attributes and picked at run time,
+ * so no -mavx2/-msse4.1 flag is needed. Builds that enable FMA (e.g. -march=native) must add
+ * -ffp-contract=off, and -ffast-math must not be used: both change the rounding of the double
+ * sums, in the scalar reference as much as in the SIMD kernels. --check-gray catches that.
+ */
+#ifndef GRAYSCALE_H
+#define GRAYSCALE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GRAYSCALE_X86 1
+#include <immintrin.h>
+#endif
+
+// Defined by each program; the reference every kernel must match
+unsigned char rgb_to_grayscale(unsigned char r, unsigned char g, unsigned char b);
+
+// Convert `width` RGBA pixels into `width` gray bytes
+typedef void (*GrayscaleRowFn)(const unsigned char* rgba, unsigned char* gray, int width);
+
+typedef struct {
+    const char* name;
+    GrayscaleRowFn convert;
+    int (*supported)(void);
+} GrayscaleKernel;
+
+static inline void grayscale_row_scalar(const unsigned char* rgba, unsigned char* gray, int width) {
+    for (int x = 0; x < width; x++) {
+        const unsigned char* px = &rgba[x * 4];
+        gray[x] = rgb_to_grayscale(px[0], px[1], px[2]);
+    }
+}
+
+static inline int grayscale_always_supported(void) {
+    return 1;
+}
+
+// Table-driven kernel. rgb_to_grayscale's weights are exact in units of 1/10000, so three
+// 256-entry tables give n = 2989 r + 5870 g + 1140 b exactly and the gray value is n / 10000.
+// The only inputs where the double sum can land on the other side of an integer are those
+// with n % 10000 == 0 (1704 of them, about 300 of which round just below); they go through
+// rgb_to_grayscale itself. The tables are built and checked against all 2^24 inputs on
+// first use, and the kernel falls back to the scalar path if that self-check fails.
+static struct {
+    unsigned int r[256];
+    unsigned int g[256];
+    unsigned int b[256];
+    int ready;
+    int verified;
+} grayscale_lut;
+
+static inline void grayscale_row_lut_unchecked(const unsigned char* rgba, unsigned char* gray, int width) {
+    for (int x = 0; x < width; x++) {
+        const unsigned char* px = &rgba[x * 4];
+        unsigned int n = grayscale_lut.r[px[0]] + grayscale_lut.g[px[1]] + grayscale_lut.b[px[2]];
+        unsigned int value = n / 10000;
+        if (n == value * 10000) {
+            gray[x] = rgb_to_grayscale(px[0], px[1], px[2]);
+            continue;
+        }
+        gray[x] = (unsigned char)(value + (value > 0 && value < 255));
+    }
+}
+
+static inline void grayscale_row_lut(const unsigned char* rgba, unsigned char* gray, int width) {
+    if (grayscale_lut.verified) {
+        grayscale_row_lut_unchecked(rgba, gray, width);
+    } else {
+        grayscale_row_scalar(rgba, gray, width);
+    }
+}
+
+static inline long verify_grayscale_kernel(GrayscaleRowFn convert);
+
+// Build the tables and run the self-check once. Always usable: on a mismatch the kernel
+// simply keeps using the double path.
+static inline int grayscale_lut_supported(void) {
+    if (!grayscale_lut.ready) {
+        for (unsigned int v = 0; v < 256; v++) {
+            grayscale_lut.r[v] = 2989 * v;
+            grayscale_lut.g[v] = 5870 * v;
+            grayscale_lut.b[v] = 1140 * v;
+        }
+        grayscale_lut.ready = 1;
+
+        long mismatches = verify_grayscale_kernel(grayscale_row_lut_unchecked);
+        grayscale_lut.verified = (mismatches == 0);
+        if (!grayscale_lut.verified) {
+            printf("Warning: grayscale lookup tables differ from rgb_to_grayscale on %ld inputs, "
+                   "using the scalar path\n", mismatches);
+        }
+    }
+    return 1;
+}
+
+#ifdef GRAYSCALE_X86
+
+// RGBA pixels loaded as little-endian 32-bit lanes are r | g << 8 | b << 16 | a << 24,
+// so each channel is a shift and a mask away.
+
+// Weighted sum of two pixels in the same order as rgb_to_grayscale, truncated to int32
+__attribute__((target("sse4.1")))
+static inline __m128i grayscale_sum2_sse41(__m128i r, __m128i g, __m128i b) {
+    __m128d sum = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(0.2989), _mm_cvtepi32_pd(r)),
+                             _mm_mul_pd(_mm_set1_pd(0.587), _mm_cvtepi32_pd(g)));
+    sum = _mm_add_pd(sum, _mm_mul_pd(_mm_set1_pd(0.114), _mm_cvtepi32_pd(b)));
+    return _mm_cvttpd_epi32(sum);
+}
+
+// The `result++` quirk: bump every value strictly between 0 and 255
+__attribute__((target("sse4.1")))
+static inline __m128i grayscale_adjust_sse41(__m128i v) {
+    __m128i mid = _mm_and_si128(_mm_cmpgt_epi32(v, _mm_setzero_si128()),
+                                _mm_cmplt_epi32(v, _mm_set1_epi32(255)));
+    return _mm_sub_epi32(v, mid);
+}
+
+__attribute__((target("sse4.1")))
+static inline void grayscale_row_sse41(const unsigned char* rgba, unsigned char* gray, int width) {
+    const __m128i byte_mask = _mm_set1_epi32(0xFF);
+    int x = 0;
+
+    // 4 pixels per iteration
+    for (; x + 4 <= width; x += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i*)(rgba + 4 * x));
+        __m128i r = _mm_and_si128(px, byte_mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(px, 8), byte_mask);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(px, 16), byte_mask);
+
+        __m128i lo = grayscale_sum2_sse41(r, g, b);
+        __m128i hi = grayscale_sum2_sse41(_mm_srli_si128(r, 8), _mm_srli_si128(g, 8), _mm_srli_si128(b, 8));
+        __m128i v = grayscale_adjust_sse41(_mm_unpacklo_epi64(lo, hi));
+
+        v = _mm_packus_epi32(v, v);
+        v = _mm_packus_epi16(v, v);
+        int packed = _mm_cvtsi128_si32(v);
+        memcpy(gray + x, &packed, 4);
+    }
+
+    grayscale_row_scalar(rgba + 4 * x, gray + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i grayscale_sum4_avx2(__m128i r, __m128i g, __m128i b) {
+    __m256d sum = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(0.2989), _mm256_cvtepi32_pd(r)),
+                                _mm256_mul_pd(_mm256_set1_pd(0.587), _mm256_cvtepi32_pd(g)));
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_set1_pd(0.114), _mm256_cvtepi32_pd(b)));
+    return _mm256_cvttpd_epi32(sum);
+}
+
+__attribute__((target("avx2")))
+static inline void grayscale_row_avx2(const unsigned char* rgba, unsigned char* gray, int width) {
+    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i white = _mm256_set1_epi32(255);
+    int x = 0;
+
+    // 8 pixels per iteration
+    for (; x + 8 <= width; x += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i*)(rgba + 4 * x));
+        __m256i r = _mm256_and_si256(px, byte_mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 8), byte_mask);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(px, 16), byte_mask);
+
+        __m128i lo = grayscale_sum4_avx2(_mm256_castsi256_si128(r), _mm256_castsi256_si128(g),
+                                         _mm256_castsi256_si128(b));
+        __m128i hi = grayscale_sum4_avx2(_mm256_extracti128_si256(r, 1), _mm256_extracti128_si256(g, 1),
+                                         _mm256_extracti128_si256(b, 1));
+        __m256i v = _mm256_set_m128i(hi, lo);
+
+        __m256i mid = _mm256_and_si256(_mm256_cmpgt_epi32(v, zero), _mm256_cmpgt_epi32(white, v));
+        v = _mm256_sub_epi32(v, mid);
+
+        // 8 x int32 -> 8 bytes (packs work per 128-bit lane, so narrow each half separately)
+        __m128i v16 = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        _mm_storel_epi64((__m128i*)(gray + x), _mm_packus_epi16(v16, v16));
+    }
+
+    grayscale_row_sse41(rgba + 4 * x, gray + x, width - x);
+}
+
+static inline int grayscale_sse41_supported(void) {
+    return __builtin_cpu_supports("sse4.1");
+}
+
+static inline int grayscale_avx2_supported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif // GRAYSCALE_X86
+
+// Fastest first; "auto" picks the first supported entry. "lut" comes after "scalar" so only
+// an explicit --gray lut pays for its start-up self-check.
+static const GrayscaleKernel grayscale_kernels[] = {
+#ifdef GRAYSCALE_X86
+    {"avx2", grayscale_row_avx2, grayscale_avx2_supported},
+    {"sse4.1", grayscale_row_sse41, grayscale_sse41_supported},
+#endif
+    {"scalar", grayscale_row_scalar, grayscale_always_supported},
+    {"lut", grayscale_row_lut, grayscale_lut_supported},
+    {NULL, NULL, NULL}
+};
+
+// Find a kernel by name ("auto" = best supported). Returns NULL if unknown or unsupported.
+static inline const GrayscaleKernel* find_grayscale_kernel(const char* name) {
+    for (const GrayscaleKernel* k = grayscale_kernels; k->name; k++) {
+        if (!k->supported()) continue;
+        if (strcmp(name, "auto") == 0 || strcmp(name, k->name) == 0) return k;
+    }
+    return NULL;
+}
+
+// Exhaustively compare a kernel with rgb_to_grayscale over all 2^24 RGB inputs. Rows of an
+// odd length are used so the SIMD tails are exercised too. Returns the number of mismatches.
+static inline long verify_grayscale_kernel(GrayscaleRowFn convert) {
+    enum { PLANE = 256 * 256, ROW = 251 };
+    unsigned char* rgba = (unsigned char*)malloc(PLANE * 4);
+    unsigned char* gray = (unsigned char*)malloc(PLANE);
+    long mismatches = 0;
+
+    for (int r = 0; r < 256; r++) {
+        for (int i = 0; i < PLANE; i++) {
+            rgba[i * 4 + 0] = (unsigned char)r;
+            rgba[i * 4 + 1] = (unsigned char)(i >> 8);
+            rgba[i * 4 + 2] = (unsigned char)i;
+            rgba[i * 4 + 3] = 0xFF;
+        }
+        for (int start = 0; start < PLANE; start += ROW) {
+            int width = (PLANE - start < ROW) ? PLANE - start : ROW;
+            convert(rgba + start * 4, gray + start, width);
+        }
+        for (int i = 0; i < PLANE; i++) {
+            if (gray[i] != rgb_to_grayscale((unsigned char)r, (unsigned char)(i >> 8), (unsigned char)i)) {
+                mismatches++;
+            }
+        }
+    }
+
+    free(rgba);
+    free(gray);
+    return mismatches;
+}
+
+// --check-gray: verify every kernel this CPU supports. Returns 0 if all match.
+static inline int check_grayscale_kernels(void) {
+    int failed = 0;
+    for (const GrayscaleKernel* k = grayscale_kernels; k->name; k++) {
+        if (!k->supported()) {
+            printf("  %-8s not supported on this CPU\n", k->name);
+            continue;
+        }
+        long mismatches = verify_grayscale_kernel(k->convert);
+        printf("  %-8s %s (%ld of 16777216 inputs differ)\n", k->name, mismatches ? "FAIL" : "ok", mismatches);
+        if (mismatches) failed = 1;
+    }
+    return failed;
+}
+
+#endif // GRAYSCALE_H
@@ -0,0 +1,207 @@
+/*
+ * Binary PGM (P5) and PBM (P4) files through mmap, shared by thread.c and error_diffusion.c.
+ *
+ * For intermediate pipeline stages PNG is pure overhead: libpng decode and encode dominate the
+ * run time. An input file is mapped and its raster is used in place, so an 8-bit graymap
+ * (maxval 255) is dithered straight from the page cache without a decode or a copy. An output
+ * file is created at its final size and mapped shared; the header is written up front and the
+ * engines write the dithered rows directly into the mapping. PBM needs one packing or
+ * unpacking pass (1 bit per pixel, 1 = black), and a PGM with a maxval other than 255 needs
+ * one scaling pass; 16-bit graymaps are not supported.
+ */
+#ifndef NETPBM_H
+#define NETPBM_H
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PNM_BITMAP 4     // P4: PBM, packed bits
+#define PNM_GRAYMAP 5    // P5: PGM, one byte per pixel
+
+// A mapped P4/P5 file. `pixels` points at the first raster row inside the mapping.
+typedef struct {
+    int format;             // PNM_BITMAP or PNM_GRAYMAP
+    int width;
+    int height;
+    int maxval;             // 1 for bitmaps
+    size_t row_bytes;       // bytes per raster row
+    unsigned char* pixels;
+    void* map;
+    size_t map_size;
+} PnmImage;
+
+// PNM_GRAYMAP for *.pgm, PNM_BITMAP for *.pbm, 0 for anything else (PNG)
+static inline int pnm_format_for_path(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    if (!dot) return 0;
+    if (strcasecmp(dot, ".pgm") == 0) return PNM_GRAYMAP;
+    if (strcasecmp(dot, ".pbm") == 0) return PNM_BITMAP;
+    return 0;
+}
+
+// Next header number at *pos, skipping whitespace and # comments; -1 if there is none
+static inline long pnm_header_number(const unsigned char* data, size_t size, size_t* pos) {
+    while (*pos < size) {
+        unsigned char c = data[*pos];
+        if (c == '#') {
+            while (*pos < size && data[*pos] != '\n') (*pos)++;
+        } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f') {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+    if (*pos >= size || data[*pos] < '0' || data[*pos] > '9') return -1;
+    long value = 0;
+    while (*pos < size && data[*pos] >= '0' && data[*pos] <= '9') {
+        value = value * 10 + (data[*pos] - '0');
+        if (value > 0x7fffffff) return -1;
+        (*pos)++;
+    }
+    return value;
+}
+
+// Nonzero if both paths name the same existing file. Creating the output truncates it, which
+// would pull the raster out from under a mapped input.
+static inline int pnm_same_file(const char* a, const char* b) {
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static inline void pnm_unmap(PnmImage* image) {
+    if (image->map) munmap(image->map, image->map_size);
+    image->map = NULL;
+    image->pixels = NULL;
+}
+
+// Map a P4 or P5 file and parse its header. The mapping is private and writable, so the raster
+// may be dithered in place without changing the file. Returns 0, or -1 after printing why not.
+static inline int pnm_map_file(const char* filename, PnmImage* image) {
+    memset(image, 0, sizeof(*image));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Could not open %s\n", filename);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 3) {
+        printf("Error: %s is not a PGM/PBM file\n", filename);
+        close(fd);
+        return -1;
+    }
+    image->map_size = (size_t)st.st_size;
+    image->map = mmap(NULL, image->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image->map == MAP_FAILED) {
+        image->map = NULL;
+        printf("Error: Could not map %s\n", filename);
+        return -1;
+    }
+
+    const unsigned char* data = (const unsigned char*)image->map;
+    size_t pos = 2;
+    image->format = (data[0] == 'P' && (data[1] == '4' || data[1] == '5')) ? data[1] - '0' : 0;
+    long width = pnm_header_number(data, image->map_size, &pos);
+    long height = pnm_header_number(data, image->map_size, &pos);
+    long maxval = (image->format == PNM_GRAYMAP) ? pnm_header_number(data, image->map_size, &pos) : 1;
+    if (!image->format || width <= 0 || height <= 0 || maxval <= 0) {
+        printf("Error: %s is not a binary PGM (P5) or PBM (P4) file\n", filename);
+        pnm_unmap(image);
+        return -1;
+    }
+    if (maxval > 255) {
+        printf("Error: %s is a 16-bit PGM, only maxval up to 255 is supported\n", filename);
+        pnm_unmap(image);
+        return -1;
+    }
+
+    // Exactly one whitespace byte separates the header from the raster
+    pos++;
+    image->width = (int)width;
+    image->height = (int)height;
+    image->maxval = (int)maxval;
+    image->row_bytes = (image->format == PNM_BITMAP) ? (size_t)(width + 7) / 8 : (size_t)width;
+    if (pos > image->map_size || (image->map_size - pos) / image->row_bytes < (size_t)height) {
+        printf("Error: %s is truncated\n", filename);
+        pnm_unmap(image);
+        return -1;
+    }
+    image->pixels = (unsigned char*)image->map + pos;
+    // The engines walk the raster top to bottom
+    madvise(image->map, image->map_size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+// Create `filename` at its final size for a width x height P4 or P5 raster, map it shared and
+// write the header. Returns 0, or -1 after printing why not.
+static inline int pnm_create_file(const char* filename, int format, int width, int height, PnmImage* image) {
+    char header[64];
+    int header_bytes = (format == PNM_BITMAP) ? snprintf(header, sizeof(header), "P4\n%d %d\n", width, height)
+                                              : snprintf(header, sizeof(header), "P5\n%d %d\n255\n", width, height);
+    memset(image, 0, sizeof(*image));
+    image->format = format;
+    image->width = width;
+    image->height = height;
+    image->maxval = (format == PNM_BITMAP) ? 1 : 255;
+    image->row_bytes = (format == PNM_BITMAP) ? (size_t)(width + 7) / 8 : (size_t)width;
+    image->map_size = header_bytes + image->row_bytes * height;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Error: Could not create %s\n", filename);
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)image->map_size) != 0) {
+        printf("Error: Could not size %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    image->map = mmap(NULL, image->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image->map == MAP_FAILED) {
+        image->map = NULL;
+        printf("Error: Could not map %s\n", filename);
+        return -1;
+    }
+    memcpy(image->map, header, header_bytes);
+    image->pixels = (unsigned char*)image->map + header_bytes;
+    return 0;
+}
+
+// PBM bits (1 = black) to 0/255 gray
+static inline void pnm_unpack_row(const unsigned char* bits, unsigned char* gray, int width) {
+    for (int x = 0; x < width; x++) {
+        gray[x] = (bits[x >> 3] & (0x80 >> (x & 7))) ? 0 : 255;
+    }
+}
+
+// Dithered 0/255 gray to PBM bits (1 = black); padding bits of the last byte stay 0
+static inline void pnm_pack_row(const unsigned char* gray, unsigned char* bits, int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const unsigned char* p = gray + x;
+        *bits++ = (unsigned char)~((p[0] & 0x80) | (p[1] & 0x40) | (p[2] & 0x20) | (p[3] & 0x10) |
+                                   (p[4] & 0x08) | (p[5] & 0x04) | (p[6] & 0x02) | (p[7] & 0x01));
+    }
+    if (x < width) {
+        unsigned char tail = 0;
+        for (int bit = 0; x < width; x++, bit++) {
+            tail |= (unsigned char)((~gray[x] & 0x80) >> bit);
+        }
+        *bits = tail;
+    }
+}
+
+// Graymap samples with another maxval to 0..255, rounded to nearest
+static inline void pnm_scale_row(const unsigned char* in, unsigned char* gray, int width, int maxval) {
+    for (int x = 0; x < width; x++) {
+        gray[x] = (unsigned char)((in[x] * 255 + maxval / 2) / maxval);
+    }
+}
+
+#endif // NETPBM_H
@@ -0,0 +1,147 @@
+/*
+ * Hardware performance counters for the dither engines, shared by thread.c, error_diffusion.c
+ * and analysis.c (--perf-counters).
+ *
+ * Each counter is a separate perf_event_open event on the calling thread. The hardware events
+ * count user space only, so they work with the default perf_event_paranoid of 2; context
+ * switches are a software event of our own process and are always allowed. Every worker
+ * thread opens its own set and the caller adds them up (perf_sample_add). Inherited counters
+ * are not used: their counts only arrive when a worker exits, which can be after pthread_join
+ * has returned, and PERF_EVENT_IOC_RESET does not clear them.
+ * Events the CPU or the VM does not expose (hardware counters are often missing in containers
+ * and VMs) read as -1 and print as "n/a", the rest still work. If the kernel multiplexes
+ * counters, values are scaled by enabled/running time.
+ */
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_NUM_COUNTERS
+};
+
+static const char* const perf_counter_names[PERF_NUM_COUNTERS] = {
+    "cycles", "instructions", "llc_misses", "branch_misses", "context_switches"
+};
+
+// Phases of one image run, counted separately by --perf-counters and timed by analysis.c
+enum { PHASE_DECODE, PHASE_GRAYSCALE, PHASE_DITHER, PHASE_ENCODE, NUM_PHASES };
+static const char* const phase_names[NUM_PHASES] = {"decode", "grayscale", "dither", "encode"};
+
+typedef struct {
+    int fd[PERF_NUM_COUNTERS];   // -1 where the event is not available
+} PerfCounters;
+
+// Counts of one measured interval; -1 where the event is not available
+typedef struct {
+    long long value[PERF_NUM_COUNTERS];
+} PerfSample;
+
+// Open all counters on the calling thread, disabled. Returns the number of events that could
+// be opened.
+static inline int perf_counters_open(PerfCounters* counters) {
+    static const struct { unsigned type; unsigned long long config; } events[PERF_NUM_COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},   // last-level cache on x86
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    };
+    int opened = 0;
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        // Context switches happen in the kernel; only the hardware events are user space only
+        attr.exclude_kernel = (events[i].type == PERF_TYPE_HARDWARE);
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fd[i] >= 0) opened++;
+    }
+    return opened;
+}
+
+static inline void perf_counters_close(PerfCounters* counters) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (counters->fd[i] >= 0) close(counters->fd[i]);
+        counters->fd[i] = -1;
+    }
+}
+
+// Zero and start every open counter
+static inline void perf_counters_start(PerfCounters* counters) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (counters->fd[i] < 0) continue;
+        ioctl(counters->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// Stop every open counter and read the counts since perf_counters_start
+static inline void perf_counters_stop(PerfCounters* counters, PerfSample* sample) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        sample->value[i] = -1;
+        if (counters->fd[i] < 0) continue;
+        ioctl(counters->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        unsigned long long data[3];   // value, time enabled, time running
+        if (read(counters->fd[i], data, sizeof(data)) != (ssize_t)sizeof(data)) continue;
+        if (data[2] > 0 && data[2] < data[1]) {
+            data[0] = (unsigned long long)((double)data[0] * data[1] / data[2]);
+        }
+        sample->value[i] = (long long)data[0];
+    }
+}
+
+// Add the counts of `sample` to `sum`; an event missing in either stays missing (-1)
+static inline void perf_sample_add(PerfSample* sum, const PerfSample* sample) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (sum->value[i] < 0 || sample->value[i] < 0) {
+            sum->value[i] = -1;
+        } else {
+            sum->value[i] += sample->value[i];
+        }
+    }
+}
+
+// Column headings matching perf_sample_print
+static inline void perf_sample_print_header(FILE* out, const char* label_heading) {
+    fprintf(out, "  %-12s", label_heading);
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        fprintf(out, " %16s", perf_counter_names[i]);
+    }
+    fprintf(out, " %6s\n", "ipc");
+}
+
+static inline void perf_sample_print(FILE* out, const char* label, const PerfSample* sample) {
+    fprintf(out, "  %-12s", label);
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (sample->value[i] < 0) {
+            fprintf(out, " %16s", "n/a");
+        } else {
+            fprintf(out, " %16lld", sample->value[i]);
+        }
+    }
+    if (sample->value[PERF_CYCLES] > 0 && sample->value[PERF_INSTRUCTIONS] >= 0) {
+        fprintf(out, " %6.2f\n", (double)sample->value[PERF_INSTRUCTIONS] / sample->value[PERF_CYCLES]);
+    } else {
+        fprintf(out, " %6s\n", "n/a");
+    }
+}
+
+#endif // PERFCOUNT_H
@@ -1,8 +1,11 @@
+import sys
+
 import pandas as pd
 import matplotlib.pyplot as plt
 
 # --- Configuration ---
 CSV_FILE = 'dithering_performance.csv'
+SWEEP_FILE = 'dithering_sweep.csv'
 PLOT_TITLE = "Multithreaded Dithering: Execution Time Analysis"
 BAR_WIDTH = 0.7
 
@@ -62,6 +65,90 @@ def plot_performance(csv_file):
     plt.tight_layout()
     plt.show()
 
+def plot_sweep(csv_file):
+    """Reads the tidy sweep CSV of 'analysis --sweep' and draws one panel per image size and pattern:
+    median dither time vs. threads, one line per engine (the single-threaded engine as a dashed line)."""
+    try:
+        df = pd.read_csv(csv_file)
+    except FileNotFoundError:
+        print(f"Error: The file '{csv_file}' was not found.")
+        print("Please run './analysis --sweep' first.")
+        return
+
+    dither = df[df['phase'] == 'dither'].copy()
+    dither['size'] = dither['width'].astype(str) + 'x' + dither['height'].astype(str)
+    sizes = list(dict.fromkeys(dither['size']))
+    patterns = list(dict.fromkeys(dither['pattern']))
+
+    # Facets: rows = pattern, columns = image size
+    fig, axes = plt.subplots(len(patterns), len(sizes), figsize=(4 * len(sizes), 3.5 * len(patterns)),
+                             squeeze=False, sharex=True)
+    fig.suptitle("Dithering Sweep: Median Dither Time by Engine and Thread Count", fontsize=16)
+
+    for row, pattern in enumerate(patterns):
+        for col, size in enumerate(sizes):
+            ax = axes[row][col]
+            panel = dither[(dither['pattern'] == pattern) & (dither['size'] == size)]
+            for engine, group in panel.groupby('engine', sort=False):
+                group = group.sort_values('threads')
+                if engine == 'st':
+                    ax.axhline(group['median_sec'].iloc[0], color='black', linestyle='--', label='st')
+                else:
+                    ax.errorbar(group['threads'], group['median_sec'],
+                                yerr=[group['median_sec'] - group['min_sec'], group['p95_sec'] - group['median_sec']],
+                                marker='o', capsize=3, label=engine)
+            ax.set_title(f'{size} {pattern}')
+            ax.set_ylim(bottom=0)
+            ax.grid(axis='y', linestyle='-', alpha=0.7)
+            if row == len(patterns) - 1:
+                ax.set_xlabel('Threads')
+            if col == 0:
+                ax.set_ylabel('Median dither time (s)')
+
+    # Error bars run from the fastest run to p95
+    axes[0][0].legend()
+    plt.tight_layout()
+    plt.show()
+
+def plot_timeline(csv_file):
+    """Reads a './thread --timeline' CSV and draws a Gantt chart: one lane per worker thread, one bar
+    per unit of work (diagonal, row or tile), coloured by the share of the unit spent waiting on
+    neighbours. Gaps between bars are scheduling and idle time."""
+    try:
+        df = pd.read_csv(csv_file)
+    except FileNotFoundError:
+        print(f"Error: The file '{csv_file}' was not found.")
+        print("Please run './thread <in.png> <out.png> <num_threads> --timeline <file.csv>' first.")
+        return
+
+    unit = df['unit'].iloc[0] if not df.empty else 'unit'
+    duration = df['end_sec'] - df['start_sec']
+    wait_share = (df['wait_sec'] / duration.where(duration > 0)).fillna(0).clip(0, 1)
+    colormap = plt.get_cmap('RdYlGn_r')
+
+    fig, ax = plt.subplots(1, 1, figsize=(12, 1 + 0.6 * df['thread'].nunique()))
+    fig.suptitle(f"Wavefront Timeline ({unit} per bar)", fontsize=16)
+    for thread, group in df.groupby('thread'):
+        spans = list(zip(group['start_sec'] * 1e3, (group['end_sec'] - group['start_sec']) * 1e3))
+        ax.broken_barh(spans, (thread - 0.4, 0.8), facecolors=[colormap(w) for w in wait_share[group.index]])
+
+    ax.set_xlabel('Time since start of dither (ms)')
+    ax.set_ylabel('Worker thread')
+    ax.set_yticks(sorted(df['thread'].unique()))
+    ax.invert_yaxis()
+    ax.grid(axis='x', linestyle='-', alpha=0.5)
+    scale = plt.cm.ScalarMappable(cmap=colormap, norm=plt.Normalize(0, 100))
+    fig.colorbar(scale, ax=ax, label=f'Share of the {unit} spent waiting (%)')
+    plt.tight_layout()
+    plt.show()
+
 if __name__ == "__main__":
-    plot_performance(CSV_FILE)
+    if '--sweep' in sys.argv[1:]:
+        plot_sweep(SWEEP_FILE)
+    elif '--timeline' in sys.argv[1:]:
+        args = sys.argv[1:]
+        position = args.index('--timeline')
+        plot_timeline(args[position + 1] if position + 1 < len(args) else 'timeline.csv')
+    else:
+        plot_performance(CSV_FILE)
 
@@ -1,45 +1,314 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <png.h>
+#include <zlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "grayscale.h"
+#include "diffusion.h"
+#include "perfcount.h"
+#include "netpbm.h"
+
+// Row starts are aligned to this many bytes
+#define IMAGE_ALIGNMENT 64
+
+// One contiguous, aligned allocation per image plane; row y starts at data + y * stride
+typedef struct {
+    int width;
+    int height;
+    size_t stride;
+    unsigned char* data;
+} ImageBuffer;
+
+static inline unsigned char* image_row(const ImageBuffer *buffer, int y) {
+    return buffer->data + (size_t)y * buffer->stride;
+}
 
 typedef struct {
     int width;
     int height;
     png_byte color_type;
     png_byte bit_depth;
-    png_bytep *row_pointers;
+    ImageBuffer *pixels;    // RGBA, 4 bytes per pixel
 } PngImage;
 
+// How write_png_file encodes the dithered plane (-1 leaves the libpng default)
+typedef struct {
+    int bit_depth;          // 8: one byte per pixel (0/255), 1: bit-packed bilevel
+    int compression_level;  // zlib level 0-9
+    int filters;            // PNG_FILTER_* mask; the default lets libpng pick per row
+    int strategy;           // zlib strategy (Z_FILTERED, Z_RLE, ...)
+} PngWriteOptions;
+
+#define PNG_WRITE_DEFAULTS { 8, -1, -1, -1 }
+
+// Name/value pairs for command-line choices
+typedef struct {
+    const char* name;
+    int value;
+} NamedValue;
+
+static const NamedValue png_filter_names[] = {
+    {"none", PNG_FILTER_NONE}, {"sub", PNG_FILTER_SUB}, {"up", PNG_FILTER_UP},
+    {"avg", PNG_FILTER_AVG}, {"paeth", PNG_FILTER_PAETH}, {"all", PNG_ALL_FILTERS},
+    {NULL, 0}
+};
+
+static const NamedValue zlib_strategy_names[] = {
+    {"default", Z_DEFAULT_STRATEGY}, {"filtered", Z_FILTERED}, {"huffman", Z_HUFFMAN_ONLY},
+    {"rle", Z_RLE}, {"fixed", Z_FIXED},
+    {NULL, 0}
+};
+
+// Futex-backed event for threads that ran out of spinning (see event_prepare). Notifying
+// costs a load unless somebody is registered.
+typedef struct {
+    atomic_int waiters;     // registered since the last notify that woke anybody
+    atomic_int sequence;    // futex word, bumped by every such notify
+} WaitEvent;
+
+// Per-row progress counter: number of leading columns of the row that are finished, and the
+// event its waiters sleep on. Padded to a full cache line so neighbouring rows do not false-share.
+#define CACHE_LINE_SIZE 64
+typedef struct {
+    atomic_int columns_done;
+    WaitEvent event;
+    char padding[CACHE_LINE_SIZE - sizeof(atomic_int) - sizeof(WaitEvent)];
+} RowProgress;
+
+// Synchronization cost counters, see read_sync_counters
+typedef struct {
+    long futex_waits;
+    long futex_wakes;
+    long context_switches;
+} SyncCounters;
+
+// Where one MT worker's time went (--wait-stats). Only the slow paths read the clock: a wait
+// whose progress is already there, or a tile that is ready at once, costs nothing.
+typedef struct {
+    long long total_ns;     // whole run of the worker
+    long long wait_ns;      // blocked on a neighbour's progress (wait_for_columns)
+    long long idle_ns;      // no tile ready (tile scheduler)
+    long waits;             // waits that had to spin or sleep
+    long sleeps;            // futex sleeps among them (including idle ones)
+} WaitStats;
+
+// One unit of work (diagonal, row or tile) in a worker's --timeline
+typedef struct {
+    int index;
+    long long start_ns;
+    long long end_ns;
+    long long wait_ns;      // part of the unit spent in wait_for_columns
+} TimelineEvent;
+
+typedef struct {
+    TimelineEvent* events;
+    int count;
+    int capacity;
+    long long unit_start;   // the unit in progress
+    long long unit_wait;    // WaitStats.wait_ns when it started
+} Timeline;
+
+// How the wavefront is split between threads
+typedef enum {
+    SCHEDULE_TILES,     // skewed tiles handed out as they become ready, with work stealing
+    SCHEDULE_DIAGONAL,  // anti-diagonals dealt round-robin (diag % num_threads)
+    SCHEDULE_ROWS       // thread t owns rows t, t+N, t+2N... and streams each left to right
+} Schedule;
+
+// CPUs worker threads are pinned to: worker i runs on cpus[i % count]. Grouped so that CPUs
+// sharing a last-level cache are consecutive.
+typedef struct {
+    int* cpus;
+    int* domains;       // cache domain of every entry (lowest CPU sharing its last-level cache)
+    int count;
+} CpuList;
+
+// Multi-threaded engine settings
+typedef struct {
+    Schedule schedule;
+    int tile_width;     // tile size for SCHEDULE_TILES, in skewed columns
+    int tile_height;    // and rows
+    const CpuList* affinity;    // NULL: threads are not pinned
+    PerfSample* thread_counters;    // not NULL: dither_image_mt counts each worker's events here
+    int wait_report;            // dither_image_mt prints where each worker's time went
+    const char* timeline_file;  // not NULL: dither_image_mt writes every work unit's times here
+} MtOptions;
+
+#define DEFAULT_TILE_WIDTH 64
+#define DEFAULT_TILE_HEIGHT 16
+#define MT_OPTIONS_DEFAULTS { SCHEDULE_TILES, DEFAULT_TILE_WIDTH, DEFAULT_TILE_HEIGHT, NULL, NULL, 0, NULL }
+
+// Ready tiles of one thread. The owner pushes and pops at the bottom (newest first, so it
+// keeps walking along its own rows); idle threads steal from the top (oldest first).
+// Indices only grow, slot = index % capacity.
+typedef struct {
+    pthread_mutex_t lock;
+    int* items;
+    int top;
+    int bottom;
+    atomic_int domain;  // cache domain of the owner's CPU, -1 until it starts; thieves look there first
+} __attribute__((aligned(CACHE_LINE_SIZE))) TileDeque;
+
+// Tile dependency graph of one image. Tiles are rectangles in skewed coordinates
+// (x + skew * y, y), in which every pixel only reads pixels up and to the left, so a tile
+// can start once its left and upper neighbours are done.
+typedef struct {
+    int tile_width;
+    int tile_height;
+    int skew;
+    int cols;
+    int rows;
+    atomic_int* dependencies;   // unfinished left/upper neighbours of every tile
+    int max_tiles;              // dependencies allocated
+    TileDeque* deques;          // one per thread
+    int num_deques;
+    int max_deques;             // deques allocated
+    int capacity;               // slots per deque
+    atomic_int ready;           // tiles sitting in some deque
+    atomic_int finished;        // tiles done
+    WaitEvent idle;             // threads waiting for a ready tile
+    const CpuList* affinity;    // CPUs the workers are pinned to, or NULL
+} TileSchedule;
+
 // Thread data structure
 typedef struct {
     int thread_id;
     int num_threads;
     int width;
     int height;
-    int** work;
-    unsigned char** output;
-    // Synchronization structures for each pixel
-    pthread_mutex_t*** pixel_mutexes;
-    pthread_cond_t*** pixel_conditions;
-    int*** pixel_processed;
+    const ImageBuffer* input;
+    ImageBuffer* output;
+    // Quantization error left behind by every processed pixel (int plane)
+    ImageBuffer* error;
+    // One progress counter per row (O(height) synchronization state)
+    RowProgress* row_progress;
+    // Ready tiles and their dependencies (tile scheduler only)
+    TileSchedule* tiles;
+    // Odd rows run right to left (row scheduler only)
+    int serpentine;
 } ThreadData;
 
+// Everything one multi-threaded dither needs besides the threads themselves
+typedef struct {
+    ImageBuffer* error;          // quantization error plane
+    RowProgress* row_progress;   // progress_rows counters
+    int progress_rows;
+    ThreadData* thread_data;     // max_threads entries
+    int max_threads;
+    TileSchedule tiles;
+    void* (*worker)(void*);      // thread entry for the chosen matrix and schedule
+} DitherTeam;
+
 // Function declarations (for cleaner structure)
+ImageBuffer* create_image_buffer(int width, int height, size_t bytes_per_pixel);
+void free_image_buffer(ImageBuffer *buffer);
+void set_rgba_transforms(png_structp png, png_infop info);
 PngImage* read_png_file(const char* filename);
 void free_png_image(PngImage *image);
 unsigned char rgb_to_grayscale(unsigned char r, unsigned char g, unsigned char b);
-void write_png_file(const char* filename, unsigned char** data, int width, int height);
+int lookup_named_value(const NamedValue* table, const char* name);
+void apply_png_write_options(png_structp png, const PngWriteOptions* options);
+void pack_row_1bit(const unsigned char* row, png_bytep packed, int width);
+int write_png_file(const char* filename, const ImageBuffer* data, const PngWriteOptions* options);
 int floor_divide(int numerator, int denominator);
-void* process_wavefront(void* arg);
-void dither_image_mt(unsigned char** input, unsigned char** output, int width, int height, int num_threads);
-void dither_image_st(unsigned char** input, unsigned char** output, int width, int height);
+double get_time_seconds(void);
+long long monotonic_ns(void);
+int parse_cpu_list(const char* text, CpuList* list);
+void free_cpu_list(CpuList* list);
+int create_worker_thread(pthread_t* thread, const CpuList* affinity, int index, void* (*run)(void*), void* arg);
+void read_sync_counters(SyncCounters* counters);
+void event_init(WaitEvent* event);
+void notify_rows(RowProgress* row, int count);
+int wait_for_columns(RowProgress* row, int columns, RowProgress* flush, int flush_count);
+RowProgress* create_row_progress(int rows);
+void tile_schedule_prepare(TileSchedule* tiles, int width, int height, int skew, int num_threads,
+                           const MtOptions* options);
+void tile_schedule_free(TileSchedule* tiles);
+void dither_team_prepare(DitherTeam* team, const ImageBuffer* input, ImageBuffer* output, int num_threads,
+                         const MtOptions* options, const DiffusionKernel* kernel, int serpentine);
+void dither_team_free(DitherTeam* team);
+void timeline_append(Timeline* timeline, int index, long long end_ns, long long wait_ns);
+void* instrumented_worker(void* arg);
+void print_wait_stats(const WaitStats* stats, int num_threads);
+int write_timeline(const char* filename, const char* unit, Timeline* timelines, int num_threads, long long origin);
+void dither_image_mt(const ImageBuffer* input, ImageBuffer* output, int num_threads, const MtOptions* options,
+                     const DiffusionKernel* kernel, int serpentine);
+void dither_image_st(const ImageBuffer* input, ImageBuffer* output, const DiffusionKernel* kernel, int serpentine);
+long long count_differing_pixels(const ImageBuffer* a, const ImageBuffer* b, int* first_x, int* first_y);
+int verify_mt_engines(const ImageBuffer* input, int num_threads, const MtOptions* options,
+                      const DiffusionKernel* kernel, int serpentine);
+void* band_worker(void* arg);
+void dither_image_bands(const ImageBuffer* input, ImageBuffer* output, int num_threads, int num_bands,
+                        int seed_rows, const DiffusionKernel* kernel, int serpentine, const CpuList* affinity);
+double image_similarity(const ImageBuffer* a, const ImageBuffer* b, long long* differing);
+double block_tone_difference(const ImageBuffer* a, const ImageBuffer* b, int block);
+int dither_png_pipeline(const char* input_file, const char* output_file, int num_threads, int queue_rows,
+                        const PngWriteOptions* write_options, GrayscaleRowFn convert_gray);
+void print_usage(const char* program);
 
 
 // ------------------------- PNG I/O and Utility Functions -------------------------
 
+ImageBuffer* create_image_buffer(int width, int height, size_t bytes_per_pixel) {
+    ImageBuffer *buffer = (ImageBuffer*)malloc(sizeof(ImageBuffer));
+    if (!buffer) return NULL;
+
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = (width * bytes_per_pixel + IMAGE_ALIGNMENT - 1) & ~(size_t)(IMAGE_ALIGNMENT - 1);
+    if (posix_memalign((void**)&buffer->data, IMAGE_ALIGNMENT, buffer->stride * height) != 0) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+void free_image_buffer(ImageBuffer *buffer) {
+    if (buffer) {
+        free(buffer->data);
+        free(buffer);
+    }
+}
+
+// Ask libpng to deliver 8-bit RGBA rows whatever the source format is
+void set_rgba_transforms(png_structp png, png_infop info) {
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth = png_get_bit_depth(png, info);
+
+    if (bit_depth == 16) png_set_strip_16(png);
+    if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
+    
+    if (color_type == PNG_COLOR_TYPE_RGB ||
+        color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+
+    if (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png);
+
+    png_read_update_info(png, info);
+}
+
 PngImage* read_png_file(const char* filename) {
     FILE *fp = fopen(filename, "rb");
     if (!fp) return NULL;
@@ -57,7 +326,13 @@ PngImage* read_png_file(const char* filename) {
         return NULL;
     }
 
+    // Allocated after setjmp, so volatile: a longjmp on a corrupt file must still free them
+    PngImage* volatile image = NULL;
+    png_bytep* volatile row_pointers = NULL;
+
     if (setjmp(png_jmpbuf(png))) {
+        free(row_pointers);
+        free_png_image(image);
         png_destroy_read_struct(&png, &info, NULL);
         fclose(fp);
         return NULL;
@@ -66,35 +341,25 @@ PngImage* read_png_file(const char* filename) {
     png_init_io(png, fp);
     png_read_info(png, info);
 
-    PngImage *image = (PngImage*)malloc(sizeof(PngImage));
+    image = (PngImage*)calloc(1, sizeof(PngImage));
+    if (!image) longjmp(png_jmpbuf(png), 1);
     image->width = png_get_image_width(png, info);
     image->height = png_get_image_height(png, info);
     image->color_type = png_get_color_type(png, info);
     image->bit_depth = png_get_bit_depth(png, info);
 
-    if (image->bit_depth == 16) png_set_strip_16(png);
-    if (image->color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
-    if (image->color_type == PNG_COLOR_TYPE_GRAY && image->bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png);
-    if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
-    
-    // Ensure 32-bit (RGBA) format for easy access (R, G, B, A)
-    if (image->color_type == PNG_COLOR_TYPE_RGB ||
-        image->color_type == PNG_COLOR_TYPE_GRAY ||
-        image->color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
-
-    if (image->color_type == PNG_COLOR_TYPE_GRAY ||
-        image->color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-        png_set_gray_to_rgb(png);
-
-    png_read_update_info(png, info);
+    set_rgba_transforms(png, info);
 
-    image->row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * image->height);
+    // Decode straight into one flat RGBA buffer; libpng only needs a temporary index of row starts
+    image->pixels = create_image_buffer(image->width, image->height, 4);
+    row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * image->height);
+    if (!image->pixels || !row_pointers) longjmp(png_jmpbuf(png), 1);
     for (int y = 0; y < image->height; y++) {
-        image->row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png, info));
+        row_pointers[y] = image_row(image->pixels, y);
     }
 
-    png_read_image(png, image->row_pointers);
+    png_read_image(png, row_pointers);
+    free(row_pointers);
     png_destroy_read_struct(&png, &info, NULL);
     fclose(fp);
 
@@ -103,10 +368,7 @@ PngImage* read_png_file(const char* filename) {
 
 void free_png_image(PngImage *image) {
     if (image) {
-        for (int y = 0; y < image->height; y++) {
-            free(image->row_pointers[y]);
-        }
-        free(image->row_pointers);
+        free_image_buffer(image->pixels);
         free(image);
     }
 }
@@ -120,54 +382,100 @@ unsigned char rgb_to_grayscale(unsigned char r, unsigned char g, unsigned char b
     return result;
 }
 
-void write_png_file(const char* filename, unsigned char** data, int width, int height) {
+// Look up a command-line name; returns -1 if it is not in the table
+int lookup_named_value(const NamedValue* table, const char* name) {
+    for (; table->name; table++) {
+        if (strcmp(table->name, name) == 0) return table->value;
+    }
+    return -1;
+}
+
+// Compression settings shared by every PNG writer
+void apply_png_write_options(png_structp png, const PngWriteOptions* options) {
+    if (options->compression_level >= 0) png_set_compression_level(png, options->compression_level);
+    if (options->filters >= 0) png_set_filter(png, PNG_FILTER_TYPE_BASE, options->filters);
+    if (options->strategy >= 0) png_set_compression_strategy(png, options->strategy);
+}
+
+// Pack a dithered row (every pixel 0 or 255) into 1 bit per pixel, most significant bit first.
+// Because pixels are 0 or 255, masking each byte with its bit position yields the packed bit.
+void pack_row_1bit(const unsigned char* row, png_bytep packed, int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const unsigned char* p = row + x;
+        *packed++ = (p[0] & 0x80) | (p[1] & 0x40) | (p[2] & 0x20) | (p[3] & 0x10) |
+                    (p[4] & 0x08) | (p[5] & 0x04) | (p[6] & 0x02) | (p[7] & 0x01);
+    }
+    if (x < width) {
+        png_byte tail = 0;
+        for (int bit = 0; x < width; x++, bit++) {
+            tail |= (row[x] & 0x80) >> bit;
+        }
+        *packed = tail;
+    }
+}
+
+// Returns 0 on success, -1 if the file could not be created or encoded
+int write_png_file(const char* filename, const ImageBuffer* data, const PngWriteOptions* options) {
+    int width = data->width;
+    int height = data->height;
+
     FILE *fp = fopen(filename, "wb");
-    if (!fp) return;
+    if (!fp) return -1;
+
+    png_bytep packed = (options->bit_depth == 1) ? (png_bytep)malloc((width + 7) / 8) : NULL;
+    if (options->bit_depth == 1 && !packed) {
+        fclose(fp);
+        return -1;
+    }
 
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png) {
+        free(packed);
         fclose(fp);
-        return;
+        return -1;
     }
 
     png_infop info = png_create_info_struct(png);
     if (!info) {
         png_destroy_write_struct(&png, NULL);
+        free(packed);
         fclose(fp);
-        return;
+        return -1;
     }
 
     if (setjmp(png_jmpbuf(png))) {
         png_destroy_write_struct(&png, &info);
+        free(packed);
         fclose(fp);
-        return;
+        return -1;
     }
 
     png_init_io(png, fp);
-    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_GRAY, 
+    png_set_IHDR(png, info, width, height, options->bit_depth, PNG_COLOR_TYPE_GRAY, 
                   PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    apply_png_write_options(png, options);
     png_write_info(png, info);
 
-    png_bytep* row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
+    // 8-bit rows are encoded in place, no copy; 1-bit rows are packed into one scratch row
     for (int y = 0; y < height; y++) {
-        row_pointers[y] = (png_byte*)malloc(width);
-        for (int x = 0; x < width; x++) {
-            row_pointers[y][x] = data[y][x];
+        if (packed) {
+            pack_row_1bit(image_row(data, y), packed, width);
+            png_write_row(png, packed);
+        } else {
+            png_write_row(png, image_row(data, y));
         }
     }
-
-    png_write_image(png, row_pointers);
     png_write_end(png, NULL);
 
-    for (int y = 0; y < height; y++) {
-        free(row_pointers[y]);
-    }
-    free(row_pointers);
+    free(packed);
     png_destroy_write_struct(&png, &info);
     fclose(fp);
+    return 0;
 }
 
-// Custom floor division function to match Python's //
+// Custom floor division function to match Python's //. The dithering loops use the
+// equivalent fs_share() from diffusion.h; this stays as its reference.
 int floor_divide(int numerator, int denominator) {
     if (numerator >= 0) {
         return numerator / denominator;
@@ -177,268 +485,2710 @@ int floor_divide(int numerator, int denominator) {
     }
 }
 
-// ------------------------- Multi-Threading Dithering Logic -------------------------
+// Monotonic wall clock in seconds
+double get_time_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-// Wavefront pattern with explicit diagonal synchronization
-void* process_wavefront(void* arg) {
-    ThreadData* data = (ThreadData*)arg;
-    int width = data->width;
-    int height = data->height;
-    
-    // Process diagonals in wavefront pattern
-    for (int diag = 0; diag < width + height - 1; diag++) {
-        // Each thread processes every num_threads-th diagonal
-        if (diag % data->num_threads != data->thread_id) {
-            continue;
-        }
-        
-        // Process all pixels in this diagonal
-        for (int y = 0; y < height; y++) {
-            int x = diag - y;
-            if (x >= 0 && x < width) {
-                
-                // --- 1. WAIT FOR DEPENDENCIES (Error from prior pixels must be written) ---
-                
-                // Wait for top-right neighbor (y-1, x+1)
-                if (y > 0 && x + 1 < width) {
-                    pthread_mutex_lock(data->pixel_mutexes[y-1][x+1]);
-                    while (!(*data->pixel_processed[y-1][x+1])) {
-                        pthread_cond_wait(data->pixel_conditions[y-1][x+1], data->pixel_mutexes[y-1][x+1]);
-                    }
-                    pthread_mutex_unlock(data->pixel_mutexes[y-1][x+1]);
-                }
-                
-                // Wait for left neighbor (y, x-1)
-                if (x > 0) {
-                    pthread_mutex_lock(data->pixel_mutexes[y][x-1]);
-                    while (!(*data->pixel_processed[y][x-1])) {
-                        pthread_cond_wait(data->pixel_conditions[y][x-1], data->pixel_mutexes[y][x-1]);
-                    }
-                    pthread_mutex_unlock(data->pixel_mutexes[y][x-1]);
-                }
-                
-                // --- 2. PROCESS THE PIXEL ---
-                
-                int old_pixel = data->work[y][x];
-                int new_pixel = (old_pixel > 128) ? 255 : 0;
-                data->output[y][x] = (unsigned char)new_pixel;
-                int err = old_pixel - new_pixel;
-
-                // --- 3. PROPAGATE ERROR (Requires Lock on Target Pixels to prevent race conditions) ---
-                
-                // (y, x + 1) -> 7/16
-                if (x + 1 < width) {
-                    pthread_mutex_lock(data->pixel_mutexes[y][x + 1]);
-                    data->work[y][x + 1] += floor_divide(err * 7, 16);
-                    pthread_mutex_unlock(data->pixel_mutexes[y][x + 1]);
-                }
-                
-                if (y + 1 < height) {
-                    // (y + 1, x - 1) -> 3/16
-                    if (x - 1 >= 0) {
-                        pthread_mutex_lock(data->pixel_mutexes[y + 1][x - 1]);
-                        data->work[y + 1][x - 1] += floor_divide(err * 3, 16);
-                        pthread_mutex_unlock(data->pixel_mutexes[y + 1][x - 1]);
-                    }
-                    
-                    // (y + 1, x) -> 5/16
-                    pthread_mutex_lock(data->pixel_mutexes[y + 1][x]);
-                    data->work[y + 1][x] += floor_divide(err * 5, 16);
-                    pthread_mutex_unlock(data->pixel_mutexes[y + 1][x]);
-                    
-                    // (y + 1, x + 1) -> 1/16
-                    if (x + 1 < width) {
-                        pthread_mutex_lock(data->pixel_mutexes[y + 1][x + 1]);
-                        data->work[y + 1][x + 1] += floor_divide(err * 1, 16);
-                        pthread_mutex_unlock(data->pixel_mutexes[y + 1][x + 1]);
-                    }
-                }
-                
-                // --- 4. SIGNAL COMPLETION ---
-                
-                // Mark current pixel as processed (Lock on CURRENT pixel)
-                pthread_mutex_lock(data->pixel_mutexes[y][x]);
-                *data->pixel_processed[y][x] = 1;
-                pthread_cond_broadcast(data->pixel_conditions[y][x]);
-                pthread_mutex_unlock(data->pixel_mutexes[y][x]);
+// Same clock in integer nanoseconds, for the worker time accounting
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ------------------------- Thread Placement -------------------------
+
+// Highest CPU number --cpus accepts
+#define MAX_CPUS 1024
+
+// Read the first integer of a sysfs file (a number or a CPU list such as "0-3,8"), or -1
+static int read_sysfs_int(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return -1;
+    int value;
+    if (fscanf(fp, "%d", &value) != 1) value = -1;
+    fclose(fp);
+    return value;
+}
+
+// NUMA node of `cpu` (the cpuN/nodeM link), 0 if unknown
+static int cpu_node(int cpu) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (!dir) return 0;
+    int node = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) break;
+    }
+    closedir(dir);
+    return node;
+}
+
+// Lowest CPU sharing the last-level cache with `cpu`, which names its cache domain. Falls
+// back to the CPU itself when sysfs has no cache information.
+static int cpu_cache_domain(int cpu) {
+    int best_level = 0, domain = cpu;
+    char path[128];
+    for (int index = 0; ; index++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        int level = read_sysfs_int(path);
+        if (level < 0) break;
+        if (level > best_level) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+            int first = read_sysfs_int(path);
+            if (first >= 0) {
+                best_level = level;
+                domain = first;
             }
         }
     }
-    
-    return NULL;
+    return domain;
 }
 
-// Multi-threaded dithering with diagonal dependencies
-void dither_image_mt(unsigned char** input, unsigned char** output, int width, int height, int num_threads) {
-    // Create working array
-    int** work = (int**)malloc(height * sizeof(int*));
-    for (int y = 0; y < height; y++) {
-        work[y] = (int*)malloc(width * sizeof(int));
-        for (int x = 0; x < width; x++) {
-            work[y][x] = input[y][x];
+static void add_cpu(CpuList* list, int cpu) {
+    for (int i = 0; i < list->count; i++) {
+        if (list->cpus[i] == cpu) return;
+    }
+    list->cpus[list->count++] = cpu;
+}
+
+// Parse --cpus: "all" (every CPU this process may run on) or a list such as "0-3,8,10-11".
+// CPUs are then grouped by NUMA node and last-level cache, in the order each group first
+// appears, so consecutive workers (neighbouring rows, stealing partners) share a cache.
+// Returns 0 on success, -1 on a malformed list or a CPU this process may not run on.
+int parse_cpu_list(const char* text, CpuList* list) {
+    list->cpus = (int*)malloc(MAX_CPUS * sizeof(int));
+    list->domains = (int*)malloc(MAX_CPUS * sizeof(int));
+    list->count = 0;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return -1;
+
+    if (strcmp(text, "all") == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && cpu < MAX_CPUS; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) add_cpu(list, cpu);
+        }
+    } else {
+        const char* p = text;
+        while (*p) {
+            char* end;
+            long first = strtol(p, &end, 10);
+            long last = first;
+            if (end == p) return -1;
+            if (*end == '-') {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+                if (end == p) return -1;
+            }
+            if (first < 0 || last < first || last >= MAX_CPUS) return -1;
+            for (long cpu = first; cpu <= last; cpu++) {
+                if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) return -1;
+                add_cpu(list, (int)cpu);
+            }
+            if (*end == ',') end++;
+            else if (*end) return -1;
+            p = end;
         }
     }
+    if (list->count == 0) return -1;
 
-    // Initialize synchronization structures for each pixel
-    pthread_mutex_t*** pixel_mutexes = (pthread_mutex_t***)malloc(height * sizeof(pthread_mutex_t**));
-    pthread_cond_t*** pixel_conditions = (pthread_cond_t***)malloc(height * sizeof(pthread_cond_t**));
-    int*** pixel_processed = (int***)malloc(height * sizeof(int**));
-    
-    for (int y = 0; y < height; y++) {
-        pixel_mutexes[y] = (pthread_mutex_t**)malloc(width * sizeof(pthread_mutex_t*));
-        pixel_conditions[y] = (pthread_cond_t**)malloc(width * sizeof(pthread_cond_t*));
-        pixel_processed[y] = (int**)malloc(width * sizeof(int*));
-        
-        for (int x = 0; x < width; x++) {
-            pixel_mutexes[y][x] = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
-            pixel_conditions[y][x] = (pthread_cond_t*)malloc(sizeof(pthread_cond_t));
-            pixel_processed[y][x] = (int*)malloc(sizeof(int));
-            
-            pthread_mutex_init(pixel_mutexes[y][x], NULL);
-            pthread_cond_init(pixel_conditions[y][x], NULL);
-            *pixel_processed[y][x] = 0;
+    // Stable grouping: nodes in order of first appearance, within a node its cache domains in
+    // order of first appearance, within a domain the CPUs as listed
+    int* node = (int*)malloc(list->count * sizeof(int));
+    int* domain = (int*)malloc(list->count * sizeof(int));
+    int* ordered = (int*)malloc(list->count * sizeof(int));
+    int* taken = (int*)calloc(list->count, sizeof(int));
+    for (int i = 0; i < list->count; i++) {
+        node[i] = cpu_node(list->cpus[i]);
+        domain[i] = cpu_cache_domain(list->cpus[i]);
+    }
+    int n = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (taken[i]) continue;
+        for (int j = i; j < list->count; j++) {
+            if (taken[j] || node[j] != node[i]) continue;
+            for (int k = j; k < list->count; k++) {
+                if (!taken[k] && node[k] == node[j] && domain[k] == domain[j]) {
+                    taken[k] = 1;
+                    ordered[n] = list->cpus[k];
+                    list->domains[n] = domain[k];
+                    n++;
+                }
+            }
         }
     }
+    memcpy(list->cpus, ordered, n * sizeof(int));
+    free(node);
+    free(domain);
+    free(ordered);
+    free(taken);
+    return 0;
+}
 
-    // Create threads
-    pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
-    ThreadData* thread_data = (ThreadData*)malloc(num_threads * sizeof(ThreadData));
-    
-    for (int i = 0; i < num_threads; i++) {
-        thread_data[i].thread_id = i;
-        thread_data[i].num_threads = num_threads;
-        thread_data[i].width = width;
-        thread_data[i].height = height;
-        thread_data[i].work = work;
-        thread_data[i].output = output;
-        thread_data[i].pixel_mutexes = pixel_mutexes;
-        thread_data[i].pixel_conditions = pixel_conditions;
-        thread_data[i].pixel_processed = pixel_processed;
-        
-        // Using the corrected wavefront processing function
-        pthread_create(&threads[i], NULL, process_wavefront, &thread_data[i]);
+void free_cpu_list(CpuList* list) {
+    free(list->cpus);
+    free(list->domains);
+    list->cpus = NULL;
+    list->domains = NULL;
+    list->count = 0;
+}
+
+// Cache domain of the CPU the calling worker runs on, or 0 for all workers when they are not
+// pinned. Pinned workers never migrate, so the answer stays valid for the whole run. Team slot i
+// is not necessarily pinned CPU i (batch teams are made of whichever pool workers are free).
+static int current_worker_domain(const CpuList* affinity) {
+    if (!affinity) return 0;
+    int cpu = sched_getcpu();
+    for (int i = 0; i < affinity->count; i++) {
+        if (affinity->cpus[i] == cpu) return affinity->domains[i];
     }
-    
-    // Wait for all threads to complete
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+    return 0;
+}
+
+// pthread_create, pinned to the index-th CPU of `affinity` (wrapping) unless it is NULL. The
+// affinity is part of the attributes, so the thread never runs elsewhere, and the pages it
+// touches first (error and output rows, band buffers) are placed on its own NUMA node.
+int create_worker_thread(pthread_t* thread, const CpuList* affinity, int index, void* (*run)(void*), void* arg) {
+    if (!affinity) return pthread_create(thread, NULL, run, arg);
+
+    pthread_attr_t attr;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(affinity->cpus[index % affinity->count], &set);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    int result = pthread_create(thread, &attr, run, arg);
+    pthread_attr_destroy(&attr);
+    return result;
+}
+
+// ------------------------- Multi-Threading Dithering Logic -------------------------
+
+// Number of busy-wait iterations before a waiting thread goes to sleep on a futex
+#define SPIN_LIMIT 1024
+
+// Producers publish progress with a plain release store and only look for sleeping waiters
+// every NOTIFY_INTERVAL pixels (power of two), at the end of their run and before they wait
+// themselves, which keeps the full fence of a notification off the per-pixel path
+#define NOTIFY_INTERVAL 64
+
+// Futex calls of the wavefront engines, reported after a multi-threaded dither
+static struct {
+    atomic_long waits;
+    atomic_long wakes;
+} sync_stats;
+
+// Accounting of the current worker thread, set by instrumented_worker; NULL (no accounting)
+// everywhere else
+static __thread WaitStats* worker_stats;
+static __thread Timeline* worker_timeline;
+
+static void futex_wait(atomic_int* word, int expected) {
+    atomic_fetch_add_explicit(&sync_stats.waits, 1, memory_order_relaxed);
+    if (worker_stats) worker_stats->sleeps++;
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_int* word, int count) {
+    atomic_fetch_add_explicit(&sync_stats.wakes, 1, memory_order_relaxed);
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Snapshot of the synchronization cost so far: futex calls and context switches of the process
+void read_sync_counters(SyncCounters* counters) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    counters->futex_waits = atomic_load(&sync_stats.waits);
+    counters->futex_wakes = atomic_load(&sync_stats.wakes);
+    counters->context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+void event_init(WaitEvent* event) {
+    atomic_init(&event->waiters, 0);
+    atomic_init(&event->sequence, 0);
+}
+
+// Waiting is three steps: event_prepare registers, the caller re-checks its condition with
+// a seq_cst load, and only if it still does not hold calls event_wait with the token.
+// The producer publishes, then issues a seq_cst fence or read-modify-write before calling
+// event_notify. Either
+// the producer sees the registration, or the re-check sees the published state. A notify
+// that lands between the re-check and the sleep has already bumped the sequence, so the
+// futex returns at once.
+static inline int event_prepare(WaitEvent* event) {
+    int sequence = atomic_load_explicit(&event->sequence, memory_order_relaxed);
+    atomic_fetch_add_explicit(&event->waiters, 1, memory_order_seq_cst);
+    return sequence;
+}
+
+static inline void event_wait(WaitEvent* event, int sequence) {
+    futex_wait(&event->sequence, sequence);
+}
+
+// Wake everybody registered so far. Registrations are consumed, so a waiter that is slow to
+// get back onto a CPU does not draw a wake-up syscall from every later notify.
+static inline void event_notify(WaitEvent* event) {
+    if (atomic_load_explicit(&event->waiters, memory_order_seq_cst) > 0 &&
+        atomic_exchange_explicit(&event->waiters, 0, memory_order_seq_cst) > 0) {
+        atomic_fetch_add_explicit(&event->sequence, 1, memory_order_release);
+        futex_wake(&event->sequence, INT_MAX);
     }
-    
-    // Cleanup
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            pthread_mutex_destroy(pixel_mutexes[y][x]);
-            pthread_cond_destroy(pixel_conditions[y][x]);
-            free(pixel_mutexes[y][x]);
-            free(pixel_conditions[y][x]);
-            free(pixel_processed[y][x]);
-        }
-        free(pixel_mutexes[y]);
-        free(pixel_conditions[y]);
-        free(pixel_processed[y]);
-        free(work[y]);
-    }
-    free(pixel_mutexes);
-    free(pixel_conditions);
-    free(pixel_processed);
-    free(work);
-    free(threads);
-    free(thread_data);
 }
 
-// Single-threaded version for comparison
-void dither_image_st(unsigned char** input, unsigned char** output, int width, int height) {
-    int** work = (int**)malloc(height * sizeof(int*));
-    for (int y = 0; y < height; y++) {
-        work[y] = (int*)malloc(width * sizeof(int));
-        for (int x = 0; x < width; x++) {
-            work[y][x] = input[y][x];
-        }
+// Wake the threads waiting on any of the `count` rows starting at `row`. One fence orders
+// all our earlier release stores of columns_done before the look at the waiters.
+// (ThreadSanitizer does not model fences, hence its -Wtsan note; the fence only orders this
+// hand-shake between atomics, the pixel data is ordered by acquire/release on columns_done.)
+void notify_rows(RowProgress* row, int count) {
+    atomic_thread_fence(memory_order_seq_cst);
+    for (int i = 0; i < count; i++) {
+        event_notify(&row[i].event);
     }
+}
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int old_pixel = work[y][x];
-            int new_pixel = (old_pixel > 128) ? 255 : 0;
-            output[y][x] = (unsigned char)new_pixel;
-            int err = old_pixel - new_pixel;
-
-            if (x + 1 < width)  
-                work[y][x + 1] += floor_divide(err * 7, 16);
-            if (y + 1 < height) {
-                if (x - 1 >= 0) 
-                    work[y + 1][x - 1] += floor_divide(err * 3, 16);
-                work[y + 1][x] += floor_divide(err * 5, 16);
-                if (x + 1 < width)  
-                    work[y + 1][x + 1] += floor_divide(err * 1, 16);
-            }
+// Block until the given row has finished at least `columns` leading pixels: poll up to
+// SPIN_LIMIT times, then sleep on the row's event until its producer notifies. Before the
+// first sleep the caller's own `flush_count` rows starting at `flush`, which it may have
+// advanced without notifying, are notified, so no thread sleeps on progress already made.
+// Returns the progress actually observed, which may be further along than requested.
+// Waits that do not find the progress there at once are timed for the worker's WaitStats.
+int wait_for_columns(RowProgress* row, int columns, RowProgress* flush, int flush_count) {
+    int done = atomic_load_explicit(&row->columns_done, memory_order_acquire);
+    if (done >= columns) return done;
+
+    long long start = worker_stats ? monotonic_ns() : 0;
+    int spins = 0;
+    while ((done = atomic_load_explicit(&row->columns_done, memory_order_acquire)) < columns) {
+        if (++spins < SPIN_LIMIT) continue;
+
+        if (flush_count > 0) {
+            notify_rows(flush, flush_count);
+            flush_count = 0;
         }
+        int sequence = event_prepare(&row->event);
+        if (atomic_load_explicit(&row->columns_done, memory_order_seq_cst) < columns) {
+            event_wait(&row->event, sequence);
+        }
+    }
+    if (worker_stats) {
+        worker_stats->wait_ns += monotonic_ns() - start;
+        worker_stats->waits++;
     }
+    return done;
+}
 
-    for (int y = 0; y < height; y++) {
-        free(work[y]);
+// Mark the start and end of one unit of work (diagonal, row or tile) in the worker's --timeline
+static inline void timeline_begin(void) {
+    Timeline* timeline = worker_timeline;
+    if (timeline) {
+        timeline->unit_start = monotonic_ns();
+        timeline->unit_wait = worker_stats->wait_ns;
     }
-    free(work);
 }
 
-// ------------------------- Main Function -------------------------
+static inline void timeline_end(int index) {
+    Timeline* timeline = worker_timeline;
+    if (timeline) {
+        timeline_append(timeline, index, monotonic_ns(), worker_stats->wait_ns - timeline->unit_wait);
+    }
+}
 
-int main(int argc, char *argv[]) {
-    if (argc != 3 && argc != 4) {
-        printf("Usage: %s <input.png> <output.png> [num_threads]\n", argv[0]);
-        printf("Default: 1 thread\n");
-        return 1;
+// Error diffusion for one pixel, written in "pull" form: instead of pushing error into
+// neighbours, the pixel gathers the share of every pixel that feeds it, i.e. (x - dx, y - dy)
+// for each tap of the matrix. Every pixel only writes its own output and error cell, so no
+// locks are needed on the data path, and the integer sum is identical to the push form used
+// by dither_image_st. `rows[dy]` is the error row of image row y - dy (rows[0] is the
+// current row), or NULL above the image.
+// `direction` is the scan direction of this row (1 or -1). A row scanned right to left
+// pushes with the mirrored matrix, so a source row dy up contributes from x - d * dx, where
+// d is that row's direction: the same as ours, or flipped on odd dy when rows `alternate`
+// (serpentine scan). Always inlined with a constant matrix, direction and alternate, so the
+// tap loop is unrolled with constant weights and offsets.
+static inline __attribute__((always_inline)) void dither_pixel(const DiffusionMatrix* m, int direction,
+                                                               int alternate, const unsigned char* in,
+                                                               unsigned char* out, int* const* rows,
+                                                               int x, int width) {
+    int value = in[x];
+
+#pragma GCC unroll 16
+    for (int i = 0; i < m->num_taps; i++) {
+        const DiffusionTap* t = &m->taps[i];
+        const int* source = rows[t->dy];
+        int source_direction = (alternate && (t->dy & 1)) ? -direction : direction;
+        int sx = x - source_direction * t->dx;
+        if (source && sx >= 0 && sx < width) {
+            value += diffusion_share(source[sx], t->weight, m->divisor);
+        }
     }
 
-    const char* input_file = argv[1];
-    const char* image_output = argv[2];
-    int num_threads = (argc == 4) ? atoi(argv[3]) : 1;
+    int new_pixel = (value > 128) ? 255 : 0;
+    out[x] = (unsigned char)new_pixel;
+    rows[0][x] = value - new_pixel;
+}
 
-    PngImage *image = read_png_file(input_file);
-    if (!image) {
-        printf("Error: Could not read %s\n", input_file);
-        return 1;
+// Error rows y, y - 1, ... y - depth of an error plane, NULL above the image
+static inline __attribute__((always_inline)) void error_rows_above(const ImageBuffer* error, int y, int depth,
+                                                                   int** rows) {
+    for (int dy = 0; dy <= depth; dy++) {
+        rows[dy] = (y - dy >= 0) ? (int*)image_row(error, y - dy) : NULL;
     }
+}
 
-    // Allocate arrays
-    unsigned char** grayscale = (unsigned char**)malloc(image->height * sizeof(unsigned char*));
-    unsigned char** dithered = (unsigned char**)malloc(image->height * sizeof(unsigned char*));
-    
-    for (int y = 0; y < image->height; y++) {
-        grayscale[y] = (unsigned char*)malloc(image->width * sizeof(unsigned char));
-        dithered[y] = (unsigned char*)malloc(image->width * sizeof(unsigned char));
+// Dither one row in `direction`, publishing progress (pixels done in scan order) after every
+// pixel and notifying sleeping waiters every NOTIFY_INTERVAL pixels and at the end of the row.
+// The row above (above_progress, NULL for the first row) must be `lag` pixels ahead;
+// its progress is polled only when the last observed value is not already far enough ahead.
+// Rows further up are covered transitively, and the in-row sources are our own previous
+// pixels. When rows alternate direction the first pixel we compute already reads the last
+// pixel the row above computes, so the whole row above is needed before we can start.
+static inline __attribute__((always_inline)) void dither_row(const DiffusionMatrix* m, int lag, int direction,
+                                                             int alternate, const unsigned char* in,
+                                                             unsigned char* out, int* const* rows,
+                                                             RowProgress* above_progress,
+                                                             RowProgress* progress, int width) {
+    int above_done = 0;
+
+    for (int i = 0; i < width; i++) {
+        int x = (direction > 0) ? i : width - 1 - i;
+
+        if (above_progress) {
+            int needed = (!alternate && i + lag < width) ? i + lag : width;
+            if (above_done < needed) {
+                above_done = wait_for_columns(above_progress, needed, progress, 1);
+            }
+        }
+
+        dither_pixel(m, direction, alternate, in, out, rows, x, width);
+
+        atomic_store_explicit(&progress->columns_done, i + 1, memory_order_release);
+        if (((i + 1) & (NOTIFY_INTERVAL - 1)) == 0) {
+            notify_rows(progress, 1);
+        }
     }
+    notify_rows(progress, 1);
+}
 
-    // Convert to grayscale
-    for (int y = 0; y < image->height; y++) {
-        png_bytep row = image->row_pointers[y];
-        // Assuming 4 bytes per pixel (RGBA) after png_set_filler/png_set_gray_to_rgb
-        for (int x = 0; x < image->width; x++) {
-            png_bytep px = &(row[x * 4]);
-            grayscale[y][x] = rgb_to_grayscale(px[0], px[1], px[2]);
+// Wavefront pattern with per-row progress counters. Pixel (x, y) lies on wavefront
+// x + (lag - 1) * y: its inputs, (x + lag - 1, y - 1) and everything left of it, lie on the
+// same or earlier wavefronts, so walking each wavefront top to bottom never deadlocks.
+// For Floyd-Steinberg (lag 2) these are the plain anti-diagonals.
+static inline __attribute__((always_inline)) void* process_wavefront(void* arg, const DiffusionMatrix* m) {
+    ThreadData* data = (ThreadData*)arg;
+    int width = data->width;
+    int height = data->height;
+    int lag = diffusion_lag(m);
+    int skew = lag - 1;
+    int num_diags = width + skew * (height - 1);
+
+    // Process diagonals in wavefront pattern
+    for (int diag = data->thread_id; diag < num_diags; diag += data->num_threads) {
+        timeline_begin();
+        // Only the rows that actually intersect this diagonal (0 <= diag - skew * y < width).
+        // A matrix with no tap down and to the left has skew 0: every diagonal is a whole column.
+        int y_first = (skew == 0 || diag < width) ? 0 : (diag - width) / skew + 1;
+        int y_last = (skew == 0 || diag / skew >= height) ? height - 1 : diag / skew;
+
+        for (int y = y_first; y <= y_last; y++) {
+            int x = diag - skew * y;
+
+            // --- 1. WAIT FOR DEPENDENCIES ---
+
+            // Row above must be `lag` columns ahead (covers its rightmost source). Before
+            // sleeping, wake whoever waits on the rows of this diagonal we already finished.
+            RowProgress* done_rows = &data->row_progress[y_first];
+            if (y > 0) {
+                int needed = (x + lag < width) ? x + lag : width;
+                wait_for_columns(&data->row_progress[y - 1], needed, done_rows, y - y_first);
+            }
+            // Left neighbours live on earlier diagonals, owned by other threads
+            if (x > 0) {
+                wait_for_columns(&data->row_progress[y], x, done_rows, y - y_first);
+            }
+
+            // --- 2. PROCESS THE PIXEL ---
+
+            int* rows[DIFFUSION_MAX_DY + 1];
+            error_rows_above(data->error, y, diffusion_depth(m), rows);
+            dither_pixel(m, 1, 0, image_row(data->input, y), image_row(data->output, y), rows, x, width);
+
+            // --- 3. SIGNAL COMPLETION ---
+
+            atomic_store_explicit(&data->row_progress[y].columns_done, x + 1, memory_order_release);
         }
+
+        notify_rows(&data->row_progress[y_first], y_last - y_first + 1);
+        timeline_end(diag);
     }
 
-    // Choose single-threaded for small images or multi-threaded for larger ones
-    if (num_threads <= 1 || image->height * image->width < 10000) {
-        printf("Running single-threaded dithering.\n");
-        dither_image_st(grayscale, dithered, image->width, image->height);
-    } else {
-        printf("Running multi-threaded (wavefront) dithering with %d threads.\n", num_threads);
-        dither_image_mt(grayscale, dithered, image->width, image->height, num_threads);
+    return NULL;
+}
+
+// Row pipeline: each thread streams whole rows left to right, so its reads and writes
+// stay on contiguous cache lines. Only the row above has to be polled, and only when
+// the last observed progress is not already far enough ahead.
+// With serpentine scan odd rows run right to left. Every row then has to wait for the whole
+// row above, so rows are handed from thread to thread strictly one after another.
+static inline __attribute__((always_inline)) void* process_rows(void* arg, const DiffusionMatrix* m) {
+    ThreadData* data = (ThreadData*)arg;
+    int width = data->width;
+    int height = data->height;
+    int lag = diffusion_lag(m);
+
+    for (int y = data->thread_id; y < height; y += data->num_threads) {
+        timeline_begin();
+        int* rows[DIFFUSION_MAX_DY + 1];
+        error_rows_above(data->error, y, diffusion_depth(m), rows);
+        const unsigned char* in = image_row(data->input, y);
+        unsigned char* out = image_row(data->output, y);
+        RowProgress* above_progress = (y > 0) ? &data->row_progress[y - 1] : NULL;
+
+        if (!data->serpentine) {
+            dither_row(m, lag, 1, 0, in, out, rows, above_progress, &data->row_progress[y], width);
+        } else if (y % 2 == 0) {
+            dither_row(m, lag, 1, 1, in, out, rows, above_progress, &data->row_progress[y], width);
+        } else {
+            dither_row(m, lag, -1, 1, in, out, rows, above_progress, &data->row_progress[y], width);
+        }
+        timeline_end(y);
     }
-    
-    write_png_file(image_output, dithered, image->width, image->height);
-    printf("File %s finished.\n", image_output);
 
-    // Cleanup
-    for (int y = 0; y < image->height; y++) {
-        free(grayscale[y]);
-        free(dithered[y]);
+    return NULL;
+}
+
+static void tile_push(TileSchedule* tiles, TileDeque* deque, int tile) {
+    pthread_mutex_lock(&deque->lock);
+    deque->items[deque->bottom++ % tiles->capacity] = tile;
+    pthread_mutex_unlock(&deque->lock);
+
+    atomic_fetch_add_explicit(&tiles->ready, 1, memory_order_seq_cst);
+    event_notify(&tiles->idle);
+}
+
+// Newest tile of our own deque, or -1
+static int tile_pop(TileSchedule* tiles, TileDeque* deque) {
+    int tile = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        tile = deque->items[--deque->bottom % tiles->capacity];
     }
-    free(grayscale);
-    free(dithered);
-    free_png_image(image);
+    pthread_mutex_unlock(&deque->lock);
+    return tile;
+}
 
-    return 0;
+// Oldest tile of another thread's deque, or -1
+static int tile_steal(TileSchedule* tiles, TileDeque* deque) {
+    int tile = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        tile = deque->items[deque->top++ % tiles->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return tile;
 }
+
+// Next tile for thread `id`: its own newest, else the oldest of the next non-empty deque,
+// trying threads in our own cache domain before the others (their tiles' neighbours are
+// likely still in the shared cache). While nothing is ready, spins and then sleeps on the
+// idle event like wait_for_columns; -1 once every tile is done. Time spent without a tile
+// after the first miss counts as the worker's idle time.
+static int tile_next(TileSchedule* tiles, int id) {
+    int total = tiles->cols * tiles->rows;
+    int domain = atomic_load_explicit(&tiles->deques[id].domain, memory_order_relaxed);
+    int spins = 0;
+    long long idle_start = 0;
+
+    for (;;) {
+        if (atomic_load_explicit(&tiles->ready, memory_order_relaxed) > 0) {
+            int tile = tile_pop(tiles, &tiles->deques[id]);
+            for (int pass = 0; tile < 0 && pass < 2; pass++) {
+                for (int i = 1; tile < 0 && i < tiles->num_deques; i++) {
+                    TileDeque* victim = &tiles->deques[(id + i) % tiles->num_deques];
+                    int victim_domain = atomic_load_explicit(&victim->domain, memory_order_relaxed);
+                    if ((victim_domain == domain) == (pass == 0)) {
+                        tile = tile_steal(tiles, victim);
+                    }
+                }
+            }
+            if (tile >= 0) {
+                atomic_fetch_sub_explicit(&tiles->ready, 1, memory_order_relaxed);
+                if (idle_start) worker_stats->idle_ns += monotonic_ns() - idle_start;
+                return tile;
+            }
+        }
+        if (atomic_load_explicit(&tiles->finished, memory_order_relaxed) == total) {
+            if (idle_start) worker_stats->idle_ns += monotonic_ns() - idle_start;
+            return -1;
+        }
+        if (worker_stats && !idle_start) idle_start = monotonic_ns();
+        if (++spins < SPIN_LIMIT) continue;
+
+        int sequence = event_prepare(&tiles->idle);
+        if (atomic_load_explicit(&tiles->ready, memory_order_seq_cst) <= 0 &&
+            atomic_load_explicit(&tiles->finished, memory_order_seq_cst) < total) {
+            event_wait(&tiles->idle, sequence);
+        }
+    }
+}
+
+// One less unfinished neighbour for `tile`; the thread that clears the last one queues it.
+// acq_rel orders the pixels of both upstream tiles before whoever processes it.
+static inline void tile_release(TileSchedule* tiles, TileDeque* deque, int tile) {
+    if (atomic_fetch_sub_explicit(&tiles->dependencies[tile], 1, memory_order_acq_rel) == 1) {
+        tile_push(tiles, deque, tile);
+    }
+}
+
+// Tile scheduler: every tile covers tile_height rows and, in row y, the pixels with
+// u0 <= x + skew * y < u0 + tile_width. A pixel's sources lie on the same or earlier skewed
+// columns of earlier rows (see process_wavefront) or to its left, so inside a tile rows run
+// top to bottom, left to right, with no synchronization at all. Only finishing a tile
+// touches shared state, which keeps threads busy at the ramp-up and ramp-down of the
+// wavefront and on very wide or very tall images.
+static inline __attribute__((always_inline)) void* process_tiles(void* arg, const DiffusionMatrix* m) {
+    ThreadData* data = (ThreadData*)arg;
+    TileSchedule* tiles = data->tiles;
+    TileDeque* own = &tiles->deques[data->thread_id];
+    int width = data->width;
+    int height = data->height;
+    int skew = tiles->skew;
+    // Only a hint for the steal order, so relaxed is enough
+    atomic_store_explicit(&own->domain, current_worker_domain(tiles->affinity), memory_order_relaxed);
+
+    int tile;
+    while ((tile = tile_next(tiles, data->thread_id)) >= 0) {
+        timeline_begin();
+        int ty = tile / tiles->cols;
+        int tx = tile % tiles->cols;
+        int u0 = tx * tiles->tile_width;
+        int y0 = ty * tiles->tile_height;
+        int y1 = (y0 + tiles->tile_height < height) ? y0 + tiles->tile_height : height;
+
+        for (int y = y0; y < y1; y++) {
+            int x_begin = u0 - skew * y;
+            int x_end = x_begin + tiles->tile_width;
+            if (x_begin < 0) x_begin = 0;
+            if (x_end > width) x_end = width;
+            if (x_begin >= x_end) continue;
+
+            int* rows[DIFFUSION_MAX_DY + 1];
+            error_rows_above(data->error, y, diffusion_depth(m), rows);
+            const unsigned char* in = image_row(data->input, y);
+            unsigned char* out = image_row(data->output, y);
+            for (int x = x_begin; x < x_end; x++) {
+                dither_pixel(m, 1, 0, in, out, rows, x, width);
+            }
+        }
+
+        // Queue the tile below first, so the one to the right is popped next
+        if (ty + 1 < tiles->rows) tile_release(tiles, own, tile + tiles->cols);
+        if (tx + 1 < tiles->cols) tile_release(tiles, own, tile + 1);
+        // The last tile sends every sleeping thread home
+        if (atomic_fetch_add_explicit(&tiles->finished, 1, memory_order_seq_cst) + 1 == tiles->cols * tiles->rows) {
+            event_notify(&tiles->idle);
+        }
+        timeline_end(tile);
+    }
+
+    return NULL;
+}
+
+// One set of thread entry points per matrix, each compiled with its taps as constants
+#define DEFINE_MT_WORKERS(id)                                                          \
+    static void* process_wavefront_##id(void* arg) {                                   \
+        return process_wavefront(arg, &id##_matrix);                                   \
+    }                                                                                  \
+    static void* process_rows_##id(void* arg) {                                        \
+        return process_rows(arg, &id##_matrix);                                        \
+    }                                                                                  \
+    static void* process_tiles_##id(void* arg) {                                       \
+        return process_tiles(arg, &id##_matrix);                                       \
+    }
+DIFFUSION_MATRIX_LIST(DEFINE_MT_WORKERS)
+
+typedef struct {
+    const DiffusionMatrix* matrix;
+    void* (*wavefront)(void*);
+    void* (*rows)(void*);
+    void* (*tiles)(void*);
+} MtWorkers;
+
+#define MT_WORKERS_ENTRY(id) {&id##_matrix, process_wavefront_##id, process_rows_##id, process_tiles_##id},
+static const MtWorkers mt_workers[] = {
+    DIFFUSION_MATRIX_LIST(MT_WORKERS_ENTRY)
+    {NULL, NULL, NULL, NULL}
+};
+
+// Shared cache-line aligned progress counters, all starting at zero
+RowProgress* create_row_progress(int rows) {
+    RowProgress* row_progress = NULL;
+    if (posix_memalign((void**)&row_progress, CACHE_LINE_SIZE, rows * sizeof(RowProgress)) != 0) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int y = 0; y < rows; y++) {
+        atomic_init(&row_progress[y].columns_done, 0);
+        event_init(&row_progress[y].event);
+    }
+    return row_progress;
+}
+
+static void free_tile_deques(TileSchedule* tiles) {
+    for (int i = 0; i < tiles->max_deques; i++) {
+        pthread_mutex_destroy(&tiles->deques[i].lock);
+        free(tiles->deques[i].items);
+    }
+    free(tiles->deques);
+    tiles->deques = NULL;
+    tiles->max_deques = 0;
+    tiles->capacity = 0;
+}
+
+// Lay out the tile grid of a width x height image for `num_threads` threads and queue the
+// top-left tile. Like the rest of a DitherTeam, the allocations are kept for the next image
+// and only grow.
+void tile_schedule_prepare(TileSchedule* tiles, int width, int height, int skew, int num_threads,
+                           const MtOptions* options) {
+    tiles->tile_width = options->tile_width;
+    tiles->tile_height = options->tile_height;
+    tiles->skew = skew;
+    tiles->cols = (width + skew * (height - 1) + tiles->tile_width - 1) / tiles->tile_width;
+    tiles->rows = (height + tiles->tile_height - 1) / tiles->tile_height;
+
+    int total = tiles->cols * tiles->rows;
+    if (tiles->max_tiles < total) {
+        free(tiles->dependencies);
+        tiles->dependencies = (atomic_int*)malloc(total * sizeof(atomic_int));
+        if (!tiles->dependencies) {
+            printf("Error: Memory allocation failed\n");
+            exit(1);
+        }
+        tiles->max_tiles = total;
+    }
+    for (int ty = 0; ty < tiles->rows; ty++) {
+        for (int tx = 0; tx < tiles->cols; tx++) {
+            atomic_init(&tiles->dependencies[ty * tiles->cols + tx], (tx > 0) + (ty > 0));
+        }
+    }
+
+    // Ready tiles never depend on each other, so at most one per tile row (or column) is
+    // queued at any time
+    int capacity = (tiles->cols < tiles->rows) ? tiles->cols : tiles->rows;
+    if (tiles->max_deques < num_threads || tiles->capacity < capacity) {
+        free_tile_deques(tiles);
+        if (posix_memalign((void**)&tiles->deques, CACHE_LINE_SIZE, num_threads * sizeof(TileDeque)) != 0) {
+            printf("Error: Memory allocation failed\n");
+            exit(1);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            pthread_mutex_init(&tiles->deques[i].lock, NULL);
+            tiles->deques[i].items = (int*)malloc(capacity * sizeof(int));
+        }
+        tiles->max_deques = num_threads;
+        tiles->capacity = capacity;
+    }
+    tiles->num_deques = num_threads;
+    tiles->affinity = options->affinity;
+    for (int i = 0; i < num_threads; i++) {
+        tiles->deques[i].top = 0;
+        tiles->deques[i].bottom = 0;
+        atomic_init(&tiles->deques[i].domain, -1);
+    }
+
+    atomic_init(&tiles->finished, 0);
+    atomic_init(&tiles->ready, 0);
+    event_init(&tiles->idle);
+    tile_push(tiles, &tiles->deques[0], 0);
+}
+
+void tile_schedule_free(TileSchedule* tiles) {
+    free_tile_deques(tiles);
+    free(tiles->dependencies);
+    memset(tiles, 0, sizeof(*tiles));
+}
+
+// Prepare `team` for a multi-threaded dither of `input` with `num_threads` threads. The team
+// starts zeroed and keeps its error plane, progress counters and thread arguments between
+// images (batch mode reuses one per worker), reallocating only when an image outgrows them.
+// A serpentine scan has no diagonal wavefront, so it always uses the row scheduler.
+void dither_team_prepare(DitherTeam* team, const ImageBuffer* input, ImageBuffer* output, int num_threads,
+                         const MtOptions* options, const DiffusionKernel* kernel, int serpentine) {
+    int width = input->width;
+    int height = input->height;
+    Schedule schedule = serpentine ? SCHEDULE_ROWS : options->schedule;
+
+    // Error plane; every cell is written before it is read, so it is never cleared
+    if (!team->error || team->error->width != width || team->error->height < height) {
+        free_image_buffer(team->error);
+        team->error = create_image_buffer(width, height, sizeof(int));
+        if (!team->error) {
+            printf("Error: Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    // One cache-line aligned progress counter per row, all back at zero
+    if (schedule == SCHEDULE_TILES) {
+        tile_schedule_prepare(&team->tiles, width, height, diffusion_lag(kernel->matrix) - 1, num_threads, options);
+    } else if (team->progress_rows < height) {
+        free(team->row_progress);
+        team->row_progress = create_row_progress(height);
+        team->progress_rows = height;
+    } else {
+        for (int y = 0; y < height; y++) {
+            atomic_store_explicit(&team->row_progress[y].columns_done, 0, memory_order_relaxed);
+        }
+    }
+
+    if (team->max_threads < num_threads) {
+        free(team->thread_data);
+        team->thread_data = (ThreadData*)malloc(num_threads * sizeof(ThreadData));
+        team->max_threads = num_threads;
+    }
+
+    const MtWorkers* workers = mt_workers;
+    while (workers->matrix != kernel->matrix) workers++;
+    team->worker = (schedule == SCHEDULE_TILES) ? workers->tiles
+                 : (schedule == SCHEDULE_ROWS) ? workers->rows : workers->wavefront;
+
+    for (int i = 0; i < num_threads; i++) {
+        ThreadData* data = &team->thread_data[i];
+        data->thread_id = i;
+        data->num_threads = num_threads;
+        data->width = width;
+        data->height = height;
+        data->input = input;
+        data->output = output;
+        data->error = team->error;
+        data->row_progress = team->row_progress;
+        data->tiles = &team->tiles;
+        data->serpentine = serpentine;
+    }
+}
+
+void dither_team_free(DitherTeam* team) {
+    free_image_buffer(team->error);
+    free(team->row_progress);
+    free(team->thread_data);
+    tile_schedule_free(&team->tiles);
+    memset(team, 0, sizeof(*team));
+}
+
+// Entry of a worker that is measured: its own hardware events (MtOptions.thread_counters), where
+// its time went (wait_report) and its units of work (timeline_file)
+typedef struct {
+    void* (*run)(void*);
+    void* arg;
+    PerfSample* sample;     // NULL: no hardware counters
+    WaitStats* stats;       // NULL: no time accounting
+    Timeline* timeline;     // NULL: no timeline
+} InstrumentedWorker;
+
+void* instrumented_worker(void* arg) {
+    InstrumentedWorker* worker = (InstrumentedWorker*)arg;
+    PerfCounters counters;
+    if (worker->sample) {
+        perf_counters_open(&counters);
+        perf_counters_start(&counters);
+    }
+    worker_stats = worker->stats;
+    worker_timeline = worker->timeline;
+    long long start = worker->stats ? monotonic_ns() : 0;
+
+    void* result = worker->run(worker->arg);
+
+    if (worker->stats) worker->stats->total_ns = monotonic_ns() - start;
+    worker_stats = NULL;
+    worker_timeline = NULL;
+    if (worker->sample) {
+        perf_counters_stop(&counters, worker->sample);
+        perf_counters_close(&counters);
+    }
+    return result;
+}
+
+// Out of line, so the workers' unit loops only carry the call
+void timeline_append(Timeline* timeline, int index, long long end_ns, long long wait_ns) {
+    if (timeline->count == timeline->capacity) {
+        timeline->capacity = timeline->capacity ? 2 * timeline->capacity : 1024;
+        timeline->events = (TimelineEvent*)realloc(timeline->events, timeline->capacity * sizeof(TimelineEvent));
+        if (!timeline->events) {
+            printf("Error: Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    TimelineEvent* event = &timeline->events[timeline->count++];
+    event->index = index;
+    event->start_ns = timeline->unit_start;
+    event->end_ns = end_ns;
+    event->wait_ns = wait_ns;
+}
+
+// Per-worker table of --wait-stats. Compute is what remains of a worker's run after waiting
+// and idling, so it includes the scheduling bookkeeping.
+void print_wait_stats(const WaitStats* stats, int num_threads) {
+    WaitStats all;
+    memset(&all, 0, sizeof(all));
+    printf("Worker time:\n");
+    printf("  %-8s %10s %10s %10s %10s %6s %8s %8s\n",
+           "thread", "total s", "compute s", "wait s", "idle s", "wait%", "waits", "sleeps");
+    for (int i = 0; i <= num_threads; i++) {
+        const WaitStats* s = &all;
+        char label[16];
+        if (i < num_threads) {
+            s = &stats[i];
+            snprintf(label, sizeof(label), "%d", i);
+            all.total_ns += s->total_ns;
+            all.wait_ns += s->wait_ns;
+            all.idle_ns += s->idle_ns;
+            all.waits += s->waits;
+            all.sleeps += s->sleeps;
+        } else {
+            snprintf(label, sizeof(label), "all");
+        }
+        long long compute_ns = s->total_ns - s->wait_ns - s->idle_ns;
+        printf("  %-8s %10.4f %10.4f %10.4f %10.4f %5.1f%% %8ld %8ld\n", label, s->total_ns / 1e9,
+               compute_ns / 1e9, s->wait_ns / 1e9, s->idle_ns / 1e9,
+               s->total_ns ? 100.0 * (s->wait_ns + s->idle_ns) / s->total_ns : 0.0, s->waits, s->sleeps);
+    }
+}
+
+// One CSV line per unit of work: thread, unit kind, index, start/end and wait time in seconds
+// since `origin`. plot.py --timeline draws it as a Gantt chart. Returns 0 on success.
+int write_timeline(const char* filename, const char* unit, Timeline* timelines, int num_threads, long long origin) {
+    FILE* fp = fopen(filename, "w");
+    if (!fp) {
+        printf("Error: Could not write timeline %s\n", filename);
+        return -1;
+    }
+    fprintf(fp, "thread,unit,index,start_sec,end_sec,wait_sec\n");
+    for (int i = 0; i < num_threads; i++) {
+        for (int e = 0; e < timelines[i].count; e++) {
+            const TimelineEvent* event = &timelines[i].events[e];
+            fprintf(fp, "%d,%s,%d,%.9f,%.9f,%.9f\n", i, unit, event->index, (event->start_ns - origin) / 1e9,
+                    (event->end_ns - origin) / 1e9, event->wait_ns / 1e9);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Multi-threaded dithering with diagonal dependencies
+void dither_image_mt(const ImageBuffer* input, ImageBuffer* output, int num_threads, const MtOptions* options,
+                     const DiffusionKernel* kernel, int serpentine) {
+    DitherTeam team;
+    memset(&team, 0, sizeof(team));
+    dither_team_prepare(&team, input, output, num_threads, options, kernel, serpentine);
+
+    // Measured workers go through instrumented_worker, the others start directly
+    InstrumentedWorker* instrumented = NULL;
+    WaitStats* stats = NULL;
+    Timeline* timelines = NULL;
+    int accounting = options->wait_report || options->timeline_file;
+    if (options->thread_counters || accounting) {
+        instrumented = (InstrumentedWorker*)malloc(num_threads * sizeof(InstrumentedWorker));
+    }
+    if (accounting) {
+        stats = (WaitStats*)calloc(num_threads, sizeof(WaitStats));
+    }
+    if (options->timeline_file) {
+        timelines = (Timeline*)calloc(num_threads, sizeof(Timeline));
+    }
+    long long origin = monotonic_ns();
+
+    // Create threads; with the row scheduler pinned workers also first-touch their own rows
+    pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads; i++) {
+        if (instrumented) {
+            instrumented[i].run = team.worker;
+            instrumented[i].arg = &team.thread_data[i];
+            instrumented[i].sample = options->thread_counters ? &options->thread_counters[i] : NULL;
+            instrumented[i].stats = stats ? &stats[i] : NULL;
+            instrumented[i].timeline = timelines ? &timelines[i] : NULL;
+            create_worker_thread(&threads[i], options->affinity, i, instrumented_worker, &instrumented[i]);
+        } else {
+            create_worker_thread(&threads[i], options->affinity, i, team.worker, &team.thread_data[i]);
+        }
+    }
+
+    // Wait for all threads to complete
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (options->wait_report) {
+        print_wait_stats(stats, num_threads);
+    }
+    if (options->timeline_file) {
+        Schedule schedule = serpentine ? SCHEDULE_ROWS : options->schedule;
+        const char* unit = (schedule == SCHEDULE_TILES) ? "tile" : (schedule == SCHEDULE_ROWS) ? "row" : "diagonal";
+        if (write_timeline(options->timeline_file, unit, timelines, num_threads, origin) == 0) {
+            printf("Timeline of %d thread(s) written to %s\n", num_threads, options->timeline_file);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            free(timelines[i].events);
+        }
+    }
+
+    // Cleanup
+    free(threads);
+    free(instrumented);
+    free(stats);
+    free(timelines);
+    dither_team_free(&team);
+}
+
+// Single-threaded version for comparison; with serpentine set, odd rows run right to left
+void dither_image_st(const ImageBuffer* input, ImageBuffer* output, const DiffusionKernel* kernel, int serpentine) {
+    int width = input->width;
+    int height = input->height;
+
+    ImageBuffer* work = create_image_buffer(width, height, sizeof(int));
+    if (!work) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int y = 0; y < height; y++) {
+        const unsigned char* in = image_row(input, y);
+        int* w = (int*)image_row(work, y);
+        for (int x = 0; x < width; x++) {
+            w[x] = in[x];
+        }
+    }
+
+    for (int y = 0; y < height; y++) {
+        // The current row and the rows below it that receive error
+        int* rows[DIFFUSION_MAX_DY + 1];
+        for (int dy = 0; dy <= DIFFUSION_MAX_DY; dy++) {
+            rows[dy] = (y + dy < height) ? (int*)image_row(work, y + dy) : NULL;
+        }
+        if (serpentine && y % 2 == 1) {
+            kernel->push_row_reverse(rows, image_row(output, y), width);
+        } else {
+            kernel->push_row(rows, image_row(output, y), width);
+        }
+    }
+
+    free_image_buffer(work);
+}
+
+// Number of pixels that are not bit-identical; the first one in scan order is returned in
+// first_x/first_y (left untouched when there is none)
+long long count_differing_pixels(const ImageBuffer* a, const ImageBuffer* b, int* first_x, int* first_y) {
+    long long diff = 0;
+    for (int y = 0; y < a->height; y++) {
+        const unsigned char* row_a = image_row(a, y);
+        const unsigned char* row_b = image_row(b, y);
+        if (memcmp(row_a, row_b, a->width) == 0) continue;
+        for (int x = 0; x < a->width; x++) {
+            if (row_a[x] == row_b[x]) continue;
+            if (diff++ == 0) {
+                *first_x = x;
+                *first_y = y;
+            }
+        }
+    }
+    return diff;
+}
+
+// Runs of every scheduler checked by --verify; races rarely show up on the first run
+#define VERIFY_RUNS 5
+
+// The MT engines have no locks on the data path: every pixel pulls the error of its sources
+// and writes only its own output and error cell, and the schedule alone (acquire/release on
+// the progress counters and tile dependency counts) orders those reads after the writes.
+// This checks that claim: every scheduler, VERIFY_RUNS times with `num_threads` threads,
+// must reproduce dither_image_st bit for bit. Build with -fsanitize=thread to also have
+// every run checked for data races. Returns the number of runs that differed.
+int verify_mt_engines(const ImageBuffer* input, int num_threads, const MtOptions* options,
+                      const DiffusionKernel* kernel, int serpentine) {
+    static const Schedule schedules[] = {SCHEDULE_TILES, SCHEDULE_DIAGONAL, SCHEDULE_ROWS};
+    static const char* const schedule_names[] = {"tiles", "diagonal", "rows"};
+    ImageBuffer* reference = create_image_buffer(input->width, input->height, 1);
+    ImageBuffer* result = create_image_buffer(input->width, input->height, 1);
+    if (!reference || !result) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+
+    dither_image_st(input, reference, kernel, serpentine);
+
+    int failures = 0;
+    for (int s = 0; s < 3; s++) {
+        MtOptions run_options = *options;
+        run_options.schedule = schedules[s];
+        int failed_runs = 0;
+        for (int run = 0; run < VERIFY_RUNS; run++) {
+            memset(result->data, 0, result->stride * result->height);
+            dither_image_mt(input, result, num_threads, &run_options, kernel, serpentine);
+            int first_x = 0, first_y = 0;
+            long long differing = count_differing_pixels(result, reference, &first_x, &first_y);
+            if (differing > 0) {
+                printf("Verify %-8s run %d: %lld pixel(s) differ from single-threaded, first at (%d, %d)\n",
+                       schedule_names[s], run + 1, differing, first_x, first_y);
+                failed_runs++;
+            }
+        }
+        printf("Verify %-8s %d thread(s): %d of %d run(s) bit-identical to single-threaded\n",
+               schedule_names[s], num_threads, VERIFY_RUNS - failed_runs, VERIFY_RUNS);
+        failures += failed_runs;
+    }
+
+    free_image_buffer(reference);
+    free_image_buffer(result);
+    return failures;
+}
+
+// ------------------------- Cost Model -------------------------
+
+// Calibration cache under $HOME, unless DITHER_CALIBRATION names the file
+#define CALIBRATION_FILE ".dither_calibration"
+#define CALIBRATION_VERSION 1
+#define CALIBRATION_WIDTH 1024
+#define CALIBRATION_HEIGHT 512
+#define CALIBRATION_RUNS 3
+// Second tile size of the calibration, small enough that the per-tile cost stands out
+#define CALIBRATION_SMALL_TILE_WIDTH 8
+#define CALIBRATION_SMALL_TILE_HEIGHT 4
+#define HANDOFF_ROUND_TRIPS 10000
+#define SPAWN_SAMPLES 64
+
+#define NUM_DIFFUSION_KERNELS ((int)(sizeof(diffusion_kernels) / sizeof(diffusion_kernels[0])) - 1)
+
+// Measured costs of one matrix, in nanoseconds
+typedef struct {
+    double st_pixel;        // dither_image_st, per pixel
+    double tile_pixel;      // tile scheduler per pixel, without the per-tile overhead
+    double tile;            // tile scheduler per tile (dependency counters, deques)
+    double diagonal_pixel;  // diagonal scheduler per pixel, one thread
+    double rows_pixel;      // row scheduler per pixel, one thread
+} MatrixCosts;
+
+// Host costs behind the automatic thread count, measured once by calibrate_cost_model
+typedef struct {
+    int cpus;               // online CPUs at calibration time
+    double spawn;           // create and join one thread (ns)
+    double handoff;         // pass one value to another thread through an atomic counter (ns)
+    MatrixCosts matrix[NUM_DIFFUSION_KERNELS];   // in diffusion_kernels order
+} CostModel;
+
+int online_cpus(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus > 0) ? (int)cpus : 1;
+}
+
+static void calibration_path(char* path, size_t size) {
+    const char* file = getenv("DITHER_CALIBRATION");
+    const char* home = getenv("HOME");
+    if (file) {
+        snprintf(path, size, "%s", file);
+    } else if (home) {
+        snprintf(path, size, "%s/%s", home, CALIBRATION_FILE);
+    } else {
+        snprintf(path, size, "%s", CALIBRATION_FILE);
+    }
+}
+
+static void* spawn_probe(void* arg) {
+    return arg;
+}
+
+static void* handoff_probe(void* arg) {
+    RowProgress* counter = (RowProgress*)arg;
+    for (int i = 0; i < HANDOFF_ROUND_TRIPS; i++) {
+        wait_for_columns(counter, 2 * i + 1, NULL, 0);
+        atomic_store_explicit(&counter->columns_done, 2 * i + 2, memory_order_release);
+        notify_rows(counter, 1);
+    }
+    return NULL;
+}
+
+// Best of CALIBRATION_RUNS dithers of `input`, in ns per pixel. threads == 0 runs the ST engine.
+static double time_dither(const ImageBuffer* input, ImageBuffer* output, const DiffusionKernel* kernel,
+                          int threads, const MtOptions* options) {
+    double best = 0.0;
+    for (int run = 0; run < CALIBRATION_RUNS; run++) {
+        double start = get_time_seconds();
+        if (threads == 0) {
+            dither_image_st(input, output, kernel, 0);
+        } else {
+            dither_image_mt(input, output, threads, options, kernel, 0);
+        }
+        double elapsed = get_time_seconds() - start;
+        if (run == 0 || elapsed < best) best = elapsed;
+    }
+    return best * 1e9 / ((double)input->width * input->height);
+}
+
+static int tile_count(int width, int height, int skew, int tile_width, int tile_height) {
+    int cols = (width + skew * (height - 1) + tile_width - 1) / tile_width;
+    int rows = (height + tile_height - 1) / tile_height;
+    return cols * rows;
+}
+
+// Measure thread start-up, hand-off latency and every engine on a random plane. Takes
+// about a second; the result is cached by save_cost_model.
+void calibrate_cost_model(CostModel* model) {
+    memset(model, 0, sizeof(*model));
+    model->cpus = online_cpus();
+
+    double start = get_time_seconds();
+    for (int i = 0; i < SPAWN_SAMPLES; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, spawn_probe, NULL);
+        pthread_join(thread, NULL);
+    }
+    model->spawn = (get_time_seconds() - start) * 1e9 / SPAWN_SAMPLES;
+
+    // Ping-pong through one progress counter, the way wavefront threads wait on each other
+    RowProgress* counter = create_row_progress(1);
+    pthread_t partner;
+    pthread_create(&partner, NULL, handoff_probe, counter);
+    start = get_time_seconds();
+    for (int i = 0; i < HANDOFF_ROUND_TRIPS; i++) {
+        atomic_store_explicit(&counter->columns_done, 2 * i + 1, memory_order_release);
+        notify_rows(counter, 1);
+        wait_for_columns(counter, 2 * i + 2, NULL, 0);
+    }
+    model->handoff = (get_time_seconds() - start) * 1e9 / (2 * HANDOFF_ROUND_TRIPS);
+    pthread_join(partner, NULL);
+    free(counter);
+
+    int width = CALIBRATION_WIDTH;
+    int height = CALIBRATION_HEIGHT;
+    double pixels = (double)width * height;
+    ImageBuffer* input = create_image_buffer(width, height, 1);
+    ImageBuffer* output = create_image_buffer(width, height, 1);
+    if (!input || !output) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    srand(1);
+    for (int y = 0; y < height; y++) {
+        unsigned char* row = image_row(input, y);
+        for (int x = 0; x < width; x++) {
+            row[x] = (unsigned char)(rand() & 0xFF);
+        }
+    }
+
+    MtOptions tiles = MT_OPTIONS_DEFAULTS;
+    MtOptions small_tiles = tiles;
+    small_tiles.tile_width = CALIBRATION_SMALL_TILE_WIDTH;
+    small_tiles.tile_height = CALIBRATION_SMALL_TILE_HEIGHT;
+    MtOptions diagonal = tiles;
+    diagonal.schedule = SCHEDULE_DIAGONAL;
+    MtOptions rows = tiles;
+    rows.schedule = SCHEDULE_ROWS;
+
+    for (int k = 0; k < NUM_DIFFUSION_KERNELS; k++) {
+        const DiffusionKernel* kernel = &diffusion_kernels[k];
+        MatrixCosts* costs = &model->matrix[k];
+        double spawn_per_pixel = model->spawn / pixels;
+        int skew = diffusion_lag(kernel->matrix) - 1;
+
+        costs->st_pixel = time_dither(input, output, kernel, 0, NULL);
+        costs->diagonal_pixel = time_dither(input, output, kernel, 1, &diagonal) - spawn_per_pixel;
+        costs->rows_pixel = time_dither(input, output, kernel, 1, &rows) - spawn_per_pixel;
+
+        // Two tile sizes separate the per-pixel from the per-tile cost
+        double large = time_dither(input, output, kernel, 1, &tiles) * pixels - model->spawn;
+        double small = time_dither(input, output, kernel, 1, &small_tiles) * pixels - model->spawn;
+        int large_tiles = tile_count(width, height, skew, tiles.tile_width, tiles.tile_height);
+        int small_count = tile_count(width, height, skew, small_tiles.tile_width, small_tiles.tile_height);
+        costs->tile = (small - large) / (small_count - large_tiles);
+        if (costs->tile < 0.0) costs->tile = 0.0;
+        costs->tile_pixel = (large - large_tiles * costs->tile) / pixels;
+    }
+
+    free_image_buffer(input);
+    free_image_buffer(output);
+}
+
+// Returns 0 on success, -1 if the file cannot be written
+int save_cost_model(const CostModel* model, const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (!fp) return -1;
+    fprintf(fp, "# ./thread cost model, nanoseconds; delete or run --calibrate to refresh\n");
+    fprintf(fp, "version %d\ncpus %d\nspawn %.1f\nhandoff %.1f\n", CALIBRATION_VERSION, model->cpus,
+            model->spawn, model->handoff);
+    fprintf(fp, "# matrix st_pixel tile_pixel tile diagonal_pixel rows_pixel\n");
+    for (int k = 0; k < NUM_DIFFUSION_KERNELS; k++) {
+        const MatrixCosts* c = &model->matrix[k];
+        fprintf(fp, "%s %.3f %.3f %.1f %.3f %.3f\n", diffusion_kernels[k].matrix->name,
+                c->st_pixel, c->tile_pixel, c->tile, c->diagonal_pixel, c->rows_pixel);
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+// Returns 0 if `path` holds a complete model of this version calibrated with the current
+// number of CPUs, -1 otherwise
+int load_cost_model(CostModel* model, const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    memset(model, 0, sizeof(*model));
+    int version = 0, found = 0;
+    char line[256], name[64];
+    while (fgets(line, sizeof(line), fp)) {
+        MatrixCosts c;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "version %d", &version) == 1) continue;
+        if (sscanf(line, "cpus %d", &model->cpus) == 1) continue;
+        if (sscanf(line, "spawn %lf", &model->spawn) == 1) continue;
+        if (sscanf(line, "handoff %lf", &model->handoff) == 1) continue;
+        if (sscanf(line, "%63s %lf %lf %lf %lf %lf", name, &c.st_pixel, &c.tile_pixel, &c.tile,
+                   &c.diagonal_pixel, &c.rows_pixel) == 6) {
+            for (int k = 0; k < NUM_DIFFUSION_KERNELS; k++) {
+                if (strcmp(name, diffusion_kernels[k].matrix->name) == 0) {
+                    model->matrix[k] = c;
+                    found |= 1 << k;
+                }
+            }
+        }
+    }
+    fclose(fp);
+
+    int complete = (found == (1 << NUM_DIFFUSION_KERNELS) - 1);
+    return (version == CALIBRATION_VERSION && complete && model->cpus == online_cpus()) ? 0 : -1;
+}
+
+// Load the cached model, calibrating and caching a new one when it is missing, stale or
+// `refresh` is set
+void get_cost_model(CostModel* model, int refresh) {
+    char path[4096];
+    calibration_path(path, sizeof(path));
+    if (!refresh && load_cost_model(model, path) == 0) return;
+
+    printf("Calibrating cost model (once per host)...\n");
+    calibrate_cost_model(model);
+    if (save_cost_model(model, path) != 0) {
+        return;  // Not cached; the next auto run calibrates again
+    }
+    printf("Cost model saved to %s\n", path);
+}
+
+// Predicted nanoseconds to dither a width x height image with `threads` threads (1: ST).
+// MT time is the larger of the work share per thread and the critical path of the
+// wavefront: the chain of steps (pixels or tiles) that have to run one after another, each
+// paying a hand-off to the next thread. Thread start-up is added on top.
+double predict_dither_ns(const CostModel* model, const DiffusionKernel* kernel, const MtOptions* options,
+                         int serpentine, int width, int height, int threads) {
+    const MatrixCosts* c = &model->matrix[kernel - diffusion_kernels];
+    double pixels = (double)width * height;
+    if (threads <= 1) return pixels * c->st_pixel;
+
+    int lag = diffusion_lag(kernel->matrix);
+    int skew = lag - 1;
+    double work, critical;
+
+    if (serpentine) {
+        // Whole rows are handed over one at a time, so nothing overlaps
+        work = pixels * c->rows_pixel + height * model->handoff;
+        critical = work;
+    } else if (options->schedule == SCHEDULE_TILES) {
+        int cols = (width + skew * (height - 1) + options->tile_width - 1) / options->tile_width;
+        int rows = (height + options->tile_height - 1) / options->tile_height;
+        double tiles = (double)cols * rows;
+        double tile_work = pixels / tiles * c->tile_pixel + c->tile;
+        work = tiles * tile_work;
+        critical = (cols + rows - 1) * (tile_work + model->handoff);
+    } else if (options->schedule == SCHEDULE_DIAGONAL) {
+        // Consecutive diagonals belong to different threads: every pixel waits on another one
+        work = pixels * (c->diagonal_pixel + model->handoff);
+        critical = (width + (double)skew * (height - 1)) * (c->diagonal_pixel + model->handoff);
+    } else {
+        work = pixels * c->rows_pixel + height * model->handoff;
+        critical = (width + (double)lag * (height - 1)) * c->rows_pixel + height * model->handoff;
+    }
+
+    double share = work / threads;
+    return threads * model->spawn + ((share > critical) ? share : critical);
+}
+
+// Fastest thread count from 1 (ST) to max_threads by predict_dither_ns. More threads than
+// CPUs only add spinning, so max_threads is capped at the calibrated CPU count.
+int choose_thread_count(const CostModel* model, const DiffusionKernel* kernel, const MtOptions* options,
+                        int serpentine, int width, int height, int max_threads, double* predicted_ns) {
+    if (max_threads > model->cpus) max_threads = model->cpus;
+
+    int best = 1;
+    double best_ns = predict_dither_ns(model, kernel, options, serpentine, width, height, 1);
+    for (int threads = 2; threads <= max_threads; threads++) {
+        double ns = predict_dither_ns(model, kernel, options, serpentine, width, height, threads);
+        if (ns < best_ns) {
+            best = threads;
+            best_ns = ns;
+        }
+    }
+    if (predicted_ns) *predicted_ns = best_ns;
+    return best;
+}
+
+// --calibrate: measure, cache and print the model
+int print_cost_model(void) {
+    CostModel model;
+    get_cost_model(&model, 1);
+    printf("%d CPU(s), thread spawn %.0f ns, hand-off %.0f ns\n", model.cpus, model.spawn, model.handoff);
+    printf("  %-16s %9s %11s %9s %15s %11s (ns)\n", "matrix", "st/pixel", "tile/pixel", "per tile",
+           "diagonal/pixel", "rows/pixel");
+    for (int k = 0; k < NUM_DIFFUSION_KERNELS; k++) {
+        const MatrixCosts* c = &model.matrix[k];
+        printf("  %-16s %9.2f %11.2f %9.0f %15.2f %11.2f\n", diffusion_kernels[k].matrix->name,
+               c->st_pixel, c->tile_pixel, c->tile, c->diagonal_pixel, c->rows_pixel);
+    }
+    return 0;
+}
+
+// ------------------------- Approximate Band-Parallel Mode -------------------------
+
+// Rows dithered above each band (output discarded) to rebuild the error flowing into it
+#define DEFAULT_SEED_ROWS 16
+
+// Tile size of the tone comparison printed by --similarity
+#define TONE_BLOCK 16
+
+// Shared state of one band-parallel run; workers take bands from `next_band`
+typedef struct {
+    const ImageBuffer* input;
+    ImageBuffer* output;
+    const DiffusionKernel* kernel;
+    int serpentine;
+    int num_bands;
+    int seed_rows;
+    atomic_int next_band;
+} BandJob;
+
+// Dither band `band` on its own, starting with zero error `seed_rows` rows above it. The seed
+// rows only rebuild an approximation of the incoming error; error pushed past the band's last
+// row is dropped, since the band below rebuilds its own.
+static void dither_band(BandJob* job, int band) {
+    int width = job->input->width;
+    int height = job->input->height;
+    int y_begin = (int)((long long)band * height / job->num_bands);
+    int y_end = (int)((long long)(band + 1) * height / job->num_bands);
+    int y_seed = (y_begin > job->seed_rows) ? y_begin - job->seed_rows : 0;
+
+    ImageBuffer* work = create_image_buffer(width, y_end - y_seed, sizeof(int));
+    unsigned char* discard = (unsigned char*)malloc(width);
+    if (!work || !discard) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int y = y_seed; y < y_end; y++) {
+        const unsigned char* in = image_row(job->input, y);
+        int* w = (int*)image_row(work, y - y_seed);
+        for (int x = 0; x < width; x++) {
+            w[x] = in[x];
+        }
+    }
+
+    for (int y = y_seed; y < y_end; y++) {
+        int* rows[DIFFUSION_MAX_DY + 1];
+        for (int dy = 0; dy <= DIFFUSION_MAX_DY; dy++) {
+            rows[dy] = (y + dy < y_end) ? (int*)image_row(work, y + dy - y_seed) : NULL;
+        }
+        unsigned char* out = (y < y_begin) ? discard : image_row(job->output, y);
+        // Scan direction follows the global row index, so bands line up with the exact scan
+        if (job->serpentine && y % 2 == 1) {
+            job->kernel->push_row_reverse(rows, out, width);
+        } else {
+            job->kernel->push_row(rows, out, width);
+        }
+    }
+
+    free(discard);
+    free_image_buffer(work);
+}
+
+void* band_worker(void* arg) {
+    BandJob* job = (BandJob*)arg;
+    int band;
+    while ((band = atomic_fetch_add(&job->next_band, 1)) < job->num_bands) {
+        dither_band(job, band);
+    }
+    return NULL;
+}
+
+// Approximate dithering: the image is cut into `num_bands` horizontal bands that are dithered
+// fully independently on `num_threads` threads, so the speedup is no longer capped by the
+// wavefront. Output differs from the exact engines near band boundaries; --similarity measures
+// by how much.
+void dither_image_bands(const ImageBuffer* input, ImageBuffer* output, int num_threads, int num_bands,
+                        int seed_rows, const DiffusionKernel* kernel, int serpentine, const CpuList* affinity) {
+    BandJob job;
+    job.input = input;
+    job.output = output;
+    job.kernel = kernel;
+    job.serpentine = serpentine;
+    job.num_bands = (num_bands < input->height) ? num_bands : input->height;
+    job.seed_rows = seed_rows;
+    atomic_init(&job.next_band, 0);
+
+    pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads; i++) {
+        create_worker_thread(&threads[i], affinity, i, band_worker, &job);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Share of pixels that agree after thresholding both planes at 128, as bw_similarity.py computes it
+double image_similarity(const ImageBuffer* a, const ImageBuffer* b, long long* differing) {
+    long long diff = 0;
+    for (int y = 0; y < a->height; y++) {
+        const unsigned char* row_a = image_row(a, y);
+        const unsigned char* row_b = image_row(b, y);
+        for (int x = 0; x < a->width; x++) {
+            diff += (row_a[x] > 128) != (row_b[x] > 128);
+        }
+    }
+    *differing = diff;
+    return 1.0 - (double)diff / ((double)a->width * a->height);
+}
+
+// Mean absolute difference of the average gray level of every block x block tile. Error
+// diffusion is chaotic, so any change in the error entering a band reshuffles its dots and the
+// pixel similarity above stays low even where the tone is reproduced. Measured against the
+// grayscale input for both results, this shows whether the approximation lost any tone.
+double block_tone_difference(const ImageBuffer* a, const ImageBuffer* b, int block) {
+    double total = 0.0;
+    long long tiles = 0;
+    for (int by = 0; by < a->height; by += block) {
+        for (int bx = 0; bx < a->width; bx += block) {
+            long long sum_a = 0, sum_b = 0;
+            int y_end = (by + block < a->height) ? by + block : a->height;
+            int x_end = (bx + block < a->width) ? bx + block : a->width;
+            for (int y = by; y < y_end; y++) {
+                const unsigned char* row_a = image_row(a, y);
+                const unsigned char* row_b = image_row(b, y);
+                for (int x = bx; x < x_end; x++) {
+                    sum_a += row_a[x];
+                    sum_b += row_b[x];
+                }
+            }
+            total += fabs((double)(sum_a - sum_b)) / ((y_end - by) * (x_end - bx));
+            tiles++;
+        }
+    }
+    return total / tiles;
+}
+
+// ------------------------- Three-Stage Pipeline -------------------------
+
+// Rows buffered between two pipeline stages unless overridden with --queue-rows
+#define DEFAULT_QUEUE_ROWS 64
+
+// Number of rows a stage has published so far; later stages block on it
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int rows;
+} StageCounter;
+
+// Shared state of the decode -> dither -> encode pipeline. Rows travel through three rings of
+// `ring_rows` slots (row y lives in slot y % ring_rows), which bound the queues between stages.
+typedef struct {
+    int width;
+    int height;
+    int num_threads;
+    int ring_rows;
+    ImageBuffer* gray_ring;      // decoder -> dither
+    ImageBuffer* error_ring;     // dither rows y - 1 -> y
+    ImageBuffer* output_ring;    // dither -> encoder, already bit-packed for 1-bit output
+    PngWriteOptions write_options;
+    GrayscaleRowFn convert_gray;
+    RowProgress* row_progress;   // intra-row wavefront between dither threads
+    StageCounter decoded;
+    StageCounter dithered;
+    StageCounter encoded;
+    png_structp in_png;
+    png_infop in_info;
+    FILE* out_fp;
+    atomic_int failed;
+    // Seconds each stage spent working (not waiting on its neighbours)
+    double decode_busy;
+    double encode_busy;
+} Pipeline;
+
+typedef struct {
+    Pipeline* pipeline;
+    int thread_id;
+    unsigned char* scratch;     // 8-bit row to pack from when writing 1-bit output
+    double busy;
+} PipelineWorker;
+
+void stage_init(StageCounter* stage) {
+    pthread_mutex_init(&stage->lock, NULL);
+    pthread_cond_init(&stage->changed, NULL);
+    stage->rows = 0;
+}
+
+void stage_destroy(StageCounter* stage) {
+    pthread_mutex_destroy(&stage->lock);
+    pthread_cond_destroy(&stage->changed);
+}
+
+// Block until at least `rows` rows have been published
+void stage_wait(StageCounter* stage, int rows) {
+    pthread_mutex_lock(&stage->lock);
+    while (stage->rows < rows) {
+        pthread_cond_wait(&stage->changed, &stage->lock);
+    }
+    pthread_mutex_unlock(&stage->lock);
+}
+
+// Publish that the first `rows` rows are done. The counter only ever moves forward.
+void stage_publish(StageCounter* stage, int rows) {
+    pthread_mutex_lock(&stage->lock);
+    if (rows > stage->rows) {
+        stage->rows = rows;
+        pthread_cond_broadcast(&stage->changed);
+    }
+    pthread_mutex_unlock(&stage->lock);
+}
+
+// Decoder: row y may reuse its gray slot once row y - ring_rows, the only row that reads the
+// slot's old contents, is dithered.
+void* pipeline_decode(void* arg) {
+    Pipeline* p = (Pipeline*)arg;
+    png_bytep rgba = (png_bytep)malloc(png_get_rowbytes(p->in_png, p->in_info));
+    volatile int y = 0;
+
+    if (setjmp(png_jmpbuf(p->in_png))) {
+        atomic_store(&p->failed, 1);
+    } else {
+        for (; y < p->height; y++) {
+            stage_wait(&p->dithered, y - p->ring_rows + 1);
+
+            double start = get_time_seconds();
+            png_read_row(p->in_png, rgba, NULL);
+            p->convert_gray(rgba, image_row(p->gray_ring, y % p->ring_rows), p->width);
+            p->decode_busy += get_time_seconds() - start;
+
+            stage_publish(&p->decoded, y + 1);
+        }
+        png_read_end(p->in_png, NULL);
+    }
+
+    // After a decode error keep feeding blank rows so no other stage waits forever
+    for (; y < p->height; y++) {
+        stage_wait(&p->dithered, y - p->ring_rows + 1);
+        memset(image_row(p->gray_ring, y % p->ring_rows), 0, p->width);
+        stage_publish(&p->decoded, y + 1);
+    }
+
+    free(rgba);
+    return NULL;
+}
+
+// Dither group: thread t takes rows t, t+N, t+2N... as in --mode rows, with the error of
+// the previous row and the output coming from the rings instead of full planes.
+void* pipeline_dither(void* arg) {
+    PipelineWorker* worker = (PipelineWorker*)arg;
+    Pipeline* p = worker->pipeline;
+
+    for (int y = worker->thread_id; y < p->height; y += p->num_threads) {
+        stage_wait(&p->decoded, y + 1);
+        stage_wait(&p->encoded, y - p->ring_rows + 1);
+
+        double start = get_time_seconds();
+        int slot = y % p->ring_rows;
+        int first = (y == 0);
+        unsigned char* out = worker->scratch ? worker->scratch : image_row(p->output_ring, slot);
+        // The rings only keep the row above, so the pipeline is Floyd-Steinberg only
+        int* rows[DIFFUSION_MAX_DY + 1] = {
+            (int*)image_row(p->error_ring, slot),
+            first ? NULL : (int*)image_row(p->error_ring, (y - 1) % p->ring_rows),
+            NULL
+        };
+        dither_row(&floyd_steinberg_matrix, 2, 1, 0, image_row(p->gray_ring, slot), out, rows,
+                   first ? NULL : &p->row_progress[y - 1], &p->row_progress[y], p->width);
+        // Pack while the row is still hot in cache, so the encoder only sees 1/8 of the bytes
+        if (worker->scratch) {
+            pack_row_1bit(worker->scratch, image_row(p->output_ring, slot), p->width);
+        }
+        worker->busy += get_time_seconds() - start;
+
+        // Publish strictly in row order: the last row_progress update comes before the pack, so
+        // the thread of row y + 1 can finish while this row's slot is still being packed
+        stage_wait(&p->dithered, y);
+        stage_publish(&p->dithered, y + 1);
+    }
+
+    return NULL;
+}
+
+// Encoder: compresses rows in order as soon as they are dithered
+void* pipeline_encode(void* arg) {
+    Pipeline* p = (Pipeline*)arg;
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    volatile int y = 0;
+
+    if (!info || setjmp(png_jmpbuf(png))) {
+        atomic_store(&p->failed, 1);
+    } else {
+        png_init_io(png, p->out_fp);
+        png_set_IHDR(png, info, p->width, p->height, p->write_options.bit_depth, PNG_COLOR_TYPE_GRAY,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        apply_png_write_options(png, &p->write_options);
+        png_write_info(png, info);
+
+        for (; y < p->height; y++) {
+            stage_wait(&p->dithered, y + 1);
+
+            double start = get_time_seconds();
+            png_write_row(png, image_row(p->output_ring, y % p->ring_rows));
+            p->encode_busy += get_time_seconds() - start;
+
+            stage_publish(&p->encoded, y + 1);
+        }
+
+        double start = get_time_seconds();
+        png_write_end(png, NULL);
+        p->encode_busy += get_time_seconds() - start;
+    }
+
+    // After an encode error keep draining so the dither threads can finish
+    for (; y < p->height; y++) {
+        stage_wait(&p->dithered, y + 1);
+        stage_publish(&p->encoded, y + 1);
+    }
+
+    png_destroy_write_struct(&png, &info);
+    return NULL;
+}
+
+// Decode, dither and encode on separate cores, connected by bounded row queues, then report
+// how long each stage was busy so the limiting stage is visible. Output is identical to the
+// other engines. Returns 0 on success, -1 on failure.
+int dither_png_pipeline(const char* input_file, const char* output_file, int num_threads, int queue_rows,
+                        const PngWriteOptions* write_options, GrayscaleRowFn convert_gray) {
+    Pipeline p;
+    memset(&p, 0, sizeof(p));
+
+    FILE *in_fp = fopen(input_file, "rb");
+    if (!in_fp) return -1;
+
+    p.in_png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    p.in_info = p.in_png ? png_create_info_struct(p.in_png) : NULL;
+    if (!p.in_info || setjmp(png_jmpbuf(p.in_png))) {
+        png_destroy_read_struct(&p.in_png, &p.in_info, NULL);
+        fclose(in_fp);
+        return -1;
+    }
+
+    png_init_io(p.in_png, in_fp);
+    png_read_info(p.in_png, p.in_info);
+
+    // Interlaced images deliver every row several times, so they cannot be pipelined
+    if (png_get_interlace_type(p.in_png, p.in_info) != PNG_INTERLACE_NONE) {
+        printf("Error: Pipeline mode does not support interlaced PNGs\n");
+        png_destroy_read_struct(&p.in_png, &p.in_info, NULL);
+        fclose(in_fp);
+        return -1;
+    }
+
+    p.width = png_get_image_width(p.in_png, p.in_info);
+    p.height = png_get_image_height(p.in_png, p.in_info);
+    set_rgba_transforms(p.in_png, p.in_info);
+
+    p.out_fp = fopen(output_file, "wb");
+    if (!p.out_fp) {
+        png_destroy_read_struct(&p.in_png, &p.in_info, NULL);
+        fclose(in_fp);
+        return -1;
+    }
+
+    // Every dither thread needs its own row plus the row above in flight
+    p.num_threads = num_threads;
+    p.write_options = *write_options;
+    p.convert_gray = convert_gray;
+    int one_bit = (write_options->bit_depth == 1);
+    p.ring_rows = (queue_rows > num_threads + 2) ? queue_rows : num_threads + 2;
+    p.gray_ring = create_image_buffer(p.width, p.ring_rows, 1);
+    p.error_ring = create_image_buffer(p.width, p.ring_rows, sizeof(int));
+    p.output_ring = create_image_buffer(one_bit ? (p.width + 7) / 8 : p.width, p.ring_rows, 1);
+    if (!p.gray_ring || !p.error_ring || !p.output_ring) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    p.row_progress = create_row_progress(p.height);
+    stage_init(&p.decoded);
+    stage_init(&p.dithered);
+    stage_init(&p.encoded);
+    atomic_init(&p.failed, 0);
+
+    double start = get_time_seconds();
+
+    pthread_t decoder, encoder;
+    pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    PipelineWorker* workers = (PipelineWorker*)malloc(num_threads * sizeof(PipelineWorker));
+
+    pthread_create(&decoder, NULL, pipeline_decode, &p);
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].pipeline = &p;
+        workers[i].thread_id = i;
+        workers[i].scratch = one_bit ? (unsigned char*)malloc(p.width) : NULL;
+        workers[i].busy = 0.0;
+        pthread_create(&threads[i], NULL, pipeline_dither, &workers[i]);
+    }
+    pthread_create(&encoder, NULL, pipeline_encode, &p);
+
+    pthread_join(decoder, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(encoder, NULL);
+
+    double wall = get_time_seconds() - start;
+
+    // Per-stage report: utilization close to 100% marks the stage that limits throughput
+    double dither_busy = 0.0;
+    for (int i = 0; i < num_threads; i++) {
+        dither_busy += workers[i].busy;
+    }
+    printf("Pipeline stage busy time (wall %.4f s):\n", wall);
+    printf("  decode: %.4f s (%5.1f%%)\n", p.decode_busy, 100.0 * p.decode_busy / wall);
+    printf("  dither: %.4f s (%5.1f%% per thread, %d thread(s))\n",
+           dither_busy, 100.0 * dither_busy / (wall * num_threads), num_threads);
+    printf("  encode: %.4f s (%5.1f%%)\n", p.encode_busy, 100.0 * p.encode_busy / wall);
+
+    int failed = atomic_load(&p.failed);
+
+    // Cleanup
+    stage_destroy(&p.decoded);
+    stage_destroy(&p.dithered);
+    stage_destroy(&p.encoded);
+    free(p.row_progress);
+    free_image_buffer(p.gray_ring);
+    free_image_buffer(p.error_ring);
+    free_image_buffer(p.output_ring);
+    for (int i = 0; i < num_threads; i++) {
+        free(workers[i].scratch);
+    }
+    free(threads);
+    free(workers);
+    png_destroy_read_struct(&p.in_png, &p.in_info, NULL);
+    fclose(in_fp);
+    fclose(p.out_fp);
+
+    return failed ? -1 : 0;
+}
+
+// --verify for the pipeline, whose result only exists as an encoded file: each of VERIFY_RUNS
+// runs writes `output_file`, which is decoded again and compared pixel for pixel with
+// dither_image_st of the same input. This also covers 1-bit output, where the dither threads
+// pack their rows into the output ring themselves. Returns the number of runs that differed.
+int verify_pipeline(const char* input_file, const char* output_file, int num_threads, int queue_rows,
+                    const PngWriteOptions* write_options, GrayscaleRowFn convert_gray) {
+    PngImage* image = read_png_file(input_file);
+    if (!image) {
+        printf("Error: Could not read %s\n", input_file);
+        return VERIFY_RUNS;
+    }
+    ImageBuffer* grayscale = create_image_buffer(image->width, image->height, 1);
+    ImageBuffer* reference = create_image_buffer(image->width, image->height, 1);
+    ImageBuffer* result = create_image_buffer(image->width, image->height, 1);
+    if (!grayscale || !reference || !result) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int y = 0; y < image->height; y++) {
+        convert_gray(image_row(image->pixels, y), image_row(grayscale, y), image->width);
+    }
+    dither_image_st(grayscale, reference, &diffusion_kernels[0], 0);
+
+    int failed_runs = 0;
+    for (int run = 0; run < VERIFY_RUNS; run++) {
+        PngImage* decoded = NULL;
+        if (dither_png_pipeline(input_file, output_file, num_threads, queue_rows, write_options, convert_gray) == 0) {
+            decoded = read_png_file(output_file);
+        }
+        if (!decoded || decoded->width != image->width || decoded->height != image->height) {
+            printf("Verify pipeline run %d: no readable output\n", run + 1);
+            free_png_image(decoded);
+            failed_runs++;
+            continue;
+        }
+        // The output is gray, expanded to RGBA on decode; any channel holds the pixel
+        for (int y = 0; y < image->height; y++) {
+            const unsigned char* rgba = image_row(decoded->pixels, y);
+            unsigned char* row = image_row(result, y);
+            for (int x = 0; x < image->width; x++) {
+                row[x] = rgba[4 * x];
+            }
+        }
+        free_png_image(decoded);
+
+        int first_x = 0, first_y = 0;
+        long long differing = count_differing_pixels(result, reference, &first_x, &first_y);
+        if (differing > 0) {
+            printf("Verify pipeline run %d: %lld pixel(s) differ from single-threaded, first at (%d, %d)\n",
+                   run + 1, differing, first_x, first_y);
+            failed_runs++;
+        }
+    }
+    printf("Verify pipeline %d thread(s)%s: %d of %d run(s) bit-identical to single-threaded\n",
+           num_threads, (write_options->bit_depth == 1) ? ", 1-bit" : "", VERIFY_RUNS - failed_runs, VERIFY_RUNS);
+
+    free_image_buffer(grayscale);
+    free_image_buffer(reference);
+    free_image_buffer(result);
+    free_png_image(image);
+    return failed_runs;
+}
+
+// ------------------------- Batch Mode -------------------------
+
+// Images smaller than this are always dithered by a single worker; wavefront threads would
+// spend more time handing over rows than dithering them
+#define BATCH_TEAM_MIN_PIXELS (1 << 20)
+
+// One input/output pair of a batch
+typedef struct {
+    char* input;
+    char* output;
+} BatchItem;
+
+// A wavefront thread of some worker's image, waiting to be picked up by an idle worker
+typedef struct {
+    void* (*run)(void*);
+    ThreadData* data;
+    int* remaining;     // slots of that team still running, guarded by the pool lock
+} TeamSlot;
+
+// Long-lived worker pool shared by a whole batch. Workers take whole images while the queue
+// has any (inter-image parallelism). A worker that gets a large image once the queue has run
+// dry recruits the idle workers as wavefront threads for it (intra-image parallelism).
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // a slot was posted, an image finished or the batch ended
+    pthread_cond_t team_done;   // a team slot finished
+    const BatchItem* items;
+    int num_items;
+    int next_item;
+    int items_done;
+    int failures;
+    TeamSlot* slots;            // posted, not yet taken; at most num_workers - 1
+    int num_slots;
+    int reserved;               // idle workers promised to a team whose slots are not posted yet
+    int idle;                   // workers blocked on `wake`
+    int num_workers;
+    // Dither settings shared by every image
+    const DiffusionKernel* kernel;
+    int serpentine;
+    const MtOptions* mt_options;
+    GrayscaleRowFn convert_gray;
+    const PngWriteOptions* write_options;
+} BatchPool;
+
+typedef struct {
+    BatchPool* pool;
+    DitherTeam team;            // reused for every image this worker leads
+} BatchWorker;
+
+// Number of threads for an image of `pixels` pixels: the worker itself plus every idle worker
+// not already promised to another team or needed for an image still in the queue. The helpers
+// are reserved right away, so two workers sizing their teams at once cannot count the same
+// idle thread; a slot without a thread would leave its team spinning forever.
+static int batch_reserve_team(BatchPool* pool, long long pixels) {
+    if (pixels < BATCH_TEAM_MIN_PIXELS) return 1;
+
+    pthread_mutex_lock(&pool->lock);
+    int available = pool->idle - pool->num_slots - pool->reserved - (pool->num_items - pool->next_item);
+    int helpers = (available > 0) ? available : 0;
+    pool->reserved += helpers;
+    pthread_mutex_unlock(&pool->lock);
+    return helpers + 1;
+}
+
+// Dither with a wavefront team of `size` threads reserved by batch_reserve_team: post slots
+// 1..size-1 for the helpers, run slot 0 here, then wait until the helpers are done. Workers
+// take a waiting slot before anything else, so the reserved idle threads pick them up.
+static void batch_dither_team(BatchWorker* self, const ImageBuffer* input, ImageBuffer* output, int size) {
+    BatchPool* pool = self->pool;
+    DitherTeam* team = &self->team;
+    dither_team_prepare(team, input, output, size, pool->mt_options, pool->kernel, pool->serpentine);
+
+    int remaining = size - 1;
+    pthread_mutex_lock(&pool->lock);
+    pool->reserved -= size - 1;
+    for (int i = 1; i < size; i++) {
+        TeamSlot* slot = &pool->slots[pool->num_slots++];
+        slot->run = team->worker;
+        slot->data = &team->thread_data[i];
+        slot->remaining = &remaining;
+    }
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    team->worker(&team->thread_data[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (remaining > 0) {
+        pthread_cond_wait(&pool->team_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Decode, convert, dither and encode one image. Returns 0 on success, -1 on failure.
+static int batch_process_image(BatchWorker* self, const BatchItem* item) {
+    BatchPool* pool = self->pool;
+    double start = get_time_seconds();
+
+    PngImage* image = read_png_file(item->input);
+    if (!image) {
+        printf("Error: Could not read %s\n", item->input);
+        return -1;
+    }
+
+    ImageBuffer* grayscale = create_image_buffer(image->width, image->height, 1);
+    ImageBuffer* dithered = create_image_buffer(image->width, image->height, 1);
+    if (!grayscale || !dithered) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int y = 0; y < image->height; y++) {
+        pool->convert_gray(image_row(image->pixels, y), image_row(grayscale, y), image->width);
+    }
+
+    int size = batch_reserve_team(pool, (long long)image->width * image->height);
+    if (size > 1) {
+        batch_dither_team(self, grayscale, dithered, size);
+    } else {
+        dither_image_st(grayscale, dithered, pool->kernel, pool->serpentine);
+    }
+    int result = write_png_file(item->output, dithered, pool->write_options);
+    if (result != 0) {
+        printf("Error: Could not write %s\n", item->output);
+    } else {
+        printf("%s -> %s (%dx%d, %d thread(s), %.4f s)\n", item->input, item->output,
+               image->width, image->height, size, get_time_seconds() - start);
+    }
+
+    free_image_buffer(grayscale);
+    free_image_buffer(dithered);
+    free_png_image(image);
+    return result;
+}
+
+void* batch_worker(void* arg) {
+    BatchWorker* self = (BatchWorker*)arg;
+    BatchPool* pool = self->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        if (pool->num_slots > 0) {
+            // Another worker's wavefront thread comes first: its image is already in flight
+            TeamSlot slot = pool->slots[--pool->num_slots];
+            pthread_mutex_unlock(&pool->lock);
+            slot.run(slot.data);
+            pthread_mutex_lock(&pool->lock);
+            if (--*slot.remaining == 0) {
+                pthread_cond_broadcast(&pool->team_done);
+            }
+        } else if (pool->next_item < pool->num_items) {
+            const BatchItem* item = &pool->items[pool->next_item++];
+            pthread_mutex_unlock(&pool->lock);
+            int result = batch_process_image(self, item);
+            pthread_mutex_lock(&pool->lock);
+            if (result != 0) pool->failures++;
+            pool->items_done++;
+            pthread_cond_broadcast(&pool->wake);
+        } else if (pool->items_done == pool->num_items) {
+            break;
+        } else {
+            // Stay around until the batch ends: images still running may want helpers
+            pool->idle++;
+            pthread_cond_wait(&pool->wake, &pool->lock);
+            pool->idle--;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    dither_team_free(&self->team);
+    return NULL;
+}
+
+static int has_png_extension(const char* name) {
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(name + length - 4, ".png") == 0;
+}
+
+static void add_batch_item(BatchItem** items, int* count, int* capacity, const char* input, const char* output) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *items = (BatchItem*)realloc(*items, *capacity * sizeof(BatchItem));
+        if (!*items) {
+            printf("Error: Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    (*items)[*count].input = strdup(input);
+    (*items)[*count].output = strdup(output);
+    (*count)++;
+}
+
+// Build the batch from `source`: either a directory, whose *.png files are written under the
+// same names into `output_dir`, or a text file with one "input.png output.png" pair per line
+// (blank lines and lines starting with '#' are skipped). Returns the number of items or -1.
+int load_batch_items(const char* source, const char* output_dir, BatchItem** items) {
+    int count = 0, capacity = 0;
+    *items = NULL;
+
+    DIR* dir = opendir(source);
+    if (dir) {
+        if (!output_dir) {
+            printf("Error: --output-dir is required when --batch is a directory\n");
+            closedir(dir);
+            return -1;
+        }
+        if (mkdir(output_dir, 0777) != 0 && errno != EEXIST) {
+            printf("Error: Could not create %s\n", output_dir);
+            closedir(dir);
+            return -1;
+        }
+        struct dirent* entry;
+        char input[4096], output[4096];
+        while ((entry = readdir(dir)) != NULL) {
+            if (!has_png_extension(entry->d_name)) continue;
+            snprintf(input, sizeof(input), "%s/%s", source, entry->d_name);
+            snprintf(output, sizeof(output), "%s/%s", output_dir, entry->d_name);
+            add_batch_item(items, &count, &capacity, input, output);
+        }
+        closedir(dir);
+        return count;
+    }
+
+    FILE* fp = fopen(source, "r");
+    if (!fp) {
+        printf("Error: Could not open batch list %s\n", source);
+        return -1;
+    }
+    char line[8192], input[4096], output[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#') continue;
+        int fields = sscanf(line, "%4095s %4095s", input, output);
+        if (fields <= 0) continue;
+        if (fields != 2) {
+            printf("Error: Expected \"input output\" in %s: %s", source, line);
+            fclose(fp);
+            return -1;
+        }
+        add_batch_item(items, &count, &capacity, input, output);
+    }
+    fclose(fp);
+    return count;
+}
+
+// Dither every item on one pool of `num_workers` threads created once for the whole batch.
+// Returns the number of images that failed.
+int dither_batch(const BatchItem* items, int num_items, int num_workers, const DiffusionKernel* kernel,
+                 int serpentine, const MtOptions* mt_options, GrayscaleRowFn convert_gray,
+                 const PngWriteOptions* write_options) {
+    BatchPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.team_done, NULL);
+    pool.items = items;
+    pool.num_items = num_items;
+    pool.num_workers = num_workers;
+    pool.slots = (TeamSlot*)malloc(num_workers * sizeof(TeamSlot));
+    pool.kernel = kernel;
+    pool.serpentine = serpentine;
+    pool.mt_options = mt_options;
+    pool.convert_gray = convert_gray;
+    pool.write_options = write_options;
+
+    pthread_t* threads = (pthread_t*)malloc(num_workers * sizeof(pthread_t));
+    BatchWorker* workers = (BatchWorker*)calloc(num_workers, sizeof(BatchWorker));
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].pool = &pool;
+        create_worker_thread(&threads[i], mt_options->affinity, i, batch_worker, &workers[i]);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int failures = pool.failures;
+    free(threads);
+    free(workers);
+    free(pool.slots);
+    pthread_cond_destroy(&pool.team_done);
+    pthread_cond_destroy(&pool.wake);
+    pthread_mutex_destroy(&pool.lock);
+    return failures;
+}
+
+// ------------------------- Main Function -------------------------
+// Left out when another program includes this file to link the engines directly (analysis.c)
+#ifndef DITHER_NO_MAIN
+
+// Thread count argument: a positive number, or "auto" (returned as 0)
+int parse_thread_count(const char* arg) {
+    if (strcmp(arg, "auto") == 0) return 0;
+    int threads = atoi(arg);
+    return (threads > 0) ? threads : 1;
+}
+
+// Grayscale plane of a mapped PGM/PBM. An 8-bit graymap is used in place through `view` (the
+// mapping is private, so nothing reaches the file); a bitmap or another maxval is converted
+// into a new plane, which the caller frees. NULL if that allocation fails.
+static ImageBuffer* pnm_input_plane(const PnmImage* map, ImageBuffer* view) {
+    if (map->format == PNM_GRAYMAP && map->maxval == 255) {
+        *view = (ImageBuffer){map->width, map->height, map->row_bytes, map->pixels};
+        return view;
+    }
+    ImageBuffer* plane = create_image_buffer(map->width, map->height, 1);
+    if (!plane) return NULL;
+    for (int y = 0; y < map->height; y++) {
+        const unsigned char* row = map->pixels + (size_t)y * map->row_bytes;
+        if (map->format == PNM_BITMAP) {
+            pnm_unpack_row(row, image_row(plane, y), map->width);
+        } else {
+            pnm_scale_row(row, image_row(plane, y), map->width, map->maxval);
+        }
+    }
+    return plane;
+}
+
+// A whole non-negative number with nothing after it, or -1 if `arg` is anything else
+int parse_nonnegative_int(const char* arg) {
+    int value;
+    char trailing;
+    if (sscanf(arg, "%d%c", &value, &trailing) != 1 || value < 0) return -1;
+    return value;
+}
+
+// A whole positive number with nothing after it, or 0 if `arg` is anything else
+int parse_positive_int(const char* arg) {
+    int value = parse_nonnegative_int(arg);
+    return (value > 0) ? value : 0;
+}
+
+void print_usage(const char* program) {
+    printf("Usage: %s <input> <output> [num_threads|auto] [options]\n", program);
+    printf("       %s --batch <list.txt|dir> [--output-dir <dir>] [num_threads|auto] [options]\n", program);
+    printf("Default: one thread; one per CPU for --batch, --pipeline and --approx.\n");
+    printf("auto picks the thread count from a cost model, calibrated once per host and cached in\n");
+    printf("$DITHER_CALIBRATION, or ~/.dither_calibration if that is unset.\n");
+    printf("Input and output are PNG, or binary PGM (.pgm) / PBM (.pbm), which are read and written\n");
+    printf("through mmap without a decode or encode step.\n");
+    printf("Options:\n");
+    printf("  -m, --mode <name>           wavefront scheduler: tiles, diagonal or rows (default: tiles)\n");
+    printf("  -P, --cpus <list|all>       pin worker threads to these CPUs (e.g. 0-3,8-11), grouped by shared cache\n");
+    printf("  -t, --tile <WxH>            tile size for --mode tiles (default: %dx%d)\n", DEFAULT_TILE_WIDTH, DEFAULT_TILE_HEIGHT);
+    printf("  -M, --matrix <name>         diffusion matrix: floyd-steinberg, jarvis, stucki, atkinson or sierra\n");
+    printf("                              (default: floyd-steinberg)\n");
+    printf("  -S, --serpentine            scan odd rows right to left (no wavefront overlap, see README)\n");
+    printf("  -A, --approx                approximate mode: dither independent horizontal bands in parallel\n");
+    printf("  -b, --bands <n>             bands for --approx (default: num_threads)\n");
+    printf("  -r, --seed-rows <n>         rows dithered above each band to seed its error (default: %d)\n", DEFAULT_SEED_ROWS);
+    printf("  -R, --similarity            also run the exact engine and report similarity and timings\n");
+    printf("  -V, --verify                check every MT scheduler (or --pipeline) against single-threaded, bit for bit\n");
+    printf("  -e, --perf-counters         count cycles, instructions, LLC/branch misses and context switches\n");
+    printf("                              per phase and per worker thread (perf_event_open)\n");
+    printf("  -w, --wait-stats            print each MT worker's compute, wait and idle time\n");
+    printf("  -T, --timeline <file.csv>   write every MT work unit's start, end and wait time (plot.py --timeline)\n");
+    printf("  -p, --pipeline              overlap decode, dither (num_threads rows at a time) and encode\n");
+    printf("  -q, --queue-rows <n>        rows buffered between pipeline stages (default: %d)\n", DEFAULT_QUEUE_ROWS);
+    printf("  -B, --batch <list|dir>      dither every \"input output\" line of a list, or every PNG of a directory,\n");
+    printf("                              on one pool of num_threads workers\n");
+    printf("  -o, --output-dir <dir>      where --batch writes the images of a directory\n");
+    printf("  -1, --one-bit               write a bit-packed 1-bit grayscale PNG (for 1-bit PBM, name the output .pbm)\n");
+    printf("  -c, --compression <0-9>     zlib compression level\n");
+    printf("  -f, --filter <name>         PNG row filter: none, sub, up, avg, paeth or all (adaptive)\n");
+    printf("  -z, --strategy <name>       zlib strategy: default, filtered, huffman, rle or fixed\n");
+    printf("  -F, --fast                  fast encode preset: level 1, no filter, rle strategy\n");
+    printf("  -g, --gray <name>           grayscale kernel: auto, avx2, sse4.1, scalar or lut (default: auto)\n");
+    printf("  -G, --check-gray            verify every grayscale kernel against rgb_to_grayscale and exit\n");
+    printf("  -K, --bench-kernel          benchmark the error-distribution kernels (ns/pixel) and exit\n");
+    printf("  -C, --calibrate             re-measure and cache the cost model behind auto, print it and exit\n");
+}
+
+int main(int argc, char *argv[]) {
+    MtOptions mt_options = MT_OPTIONS_DEFAULTS;
+    CpuList affinity = {NULL, NULL, 0};
+    int pipeline = 0;
+    int queue_rows = DEFAULT_QUEUE_ROWS;
+    PngWriteOptions write_options = PNG_WRITE_DEFAULTS;
+    const GrayscaleKernel* gray_kernel = find_grayscale_kernel("auto");
+    const DiffusionKernel* kernel = &diffusion_kernels[0];
+    int serpentine = 0;
+    int approx = 0;
+    int num_bands = 0;
+    int seed_rows = DEFAULT_SEED_ROWS;
+    int report_similarity = 0;
+    int verify = 0;
+    int perf_counters = 0;
+    const char* batch_source = NULL;
+    const char* output_dir = NULL;
+
+    static struct option long_options[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"tile", required_argument, NULL, 't'},
+        {"cpus", required_argument, NULL, 'P'},
+        {"matrix", required_argument, NULL, 'M'},
+        {"serpentine", no_argument, NULL, 'S'},
+        {"approx", no_argument, NULL, 'A'},
+        {"bands", required_argument, NULL, 'b'},
+        {"seed-rows", required_argument, NULL, 'r'},
+        {"similarity", no_argument, NULL, 'R'},
+        {"verify", no_argument, NULL, 'V'},
+        {"perf-counters", no_argument, NULL, 'e'},
+        {"wait-stats", no_argument, NULL, 'w'},
+        {"timeline", required_argument, NULL, 'T'},
+        {"pipeline", no_argument, NULL, 'p'},
+        {"queue-rows", required_argument, NULL, 'q'},
+        {"batch", required_argument, NULL, 'B'},
+        {"output-dir", required_argument, NULL, 'o'},
+        {"one-bit", no_argument, NULL, '1'},
+        {"compression", required_argument, NULL, 'c'},
+        {"filter", required_argument, NULL, 'f'},
+        {"strategy", required_argument, NULL, 'z'},
+        {"fast", no_argument, NULL, 'F'},
+        {"gray", required_argument, NULL, 'g'},
+        {"check-gray", no_argument, NULL, 'G'},
+        {"bench-kernel", no_argument, NULL, 'K'},
+        {"calibrate", no_argument, NULL, 'C'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:t:P:M:SAb:r:RVewT:pq:B:o:1c:f:z:Fg:GKC", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "tiles") == 0) {
+                    mt_options.schedule = SCHEDULE_TILES;
+                } else if (strcmp(optarg, "diagonal") == 0) {
+                    mt_options.schedule = SCHEDULE_DIAGONAL;
+                } else if (strcmp(optarg, "rows") == 0) {
+                    mt_options.schedule = SCHEDULE_ROWS;
+                } else {
+                    printf("Error: Unknown mode '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                free_cpu_list(&affinity);
+                if (parse_cpu_list(optarg, &affinity) != 0) {
+                    printf("Error: CPU list must be \"all\" or like 0-3,8,10-11, using only CPUs this process may run on\n");
+                    return 1;
+                }
+                mt_options.affinity = &affinity;
+                break;
+            case 't':
+                if (sscanf(optarg, "%dx%d", &mt_options.tile_width, &mt_options.tile_height) != 2 ||
+                    mt_options.tile_width < 1 || mt_options.tile_height < 1) {
+                    printf("Error: Tile size must be WxH, e.g. %dx%d\n", DEFAULT_TILE_WIDTH, DEFAULT_TILE_HEIGHT);
+                    return 1;
+                }
+                break;
+            case 'M':
+                kernel = find_diffusion_kernel(optarg);
+                if (!kernel) {
+                    printf("Error: Unknown diffusion matrix '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                serpentine = 1;
+                break;
+            case 'A':
+                approx = 1;
+                break;
+            case 'b':
+                num_bands = parse_positive_int(optarg);
+                if (num_bands == 0) {
+                    printf("Error: Bands must be a positive number\n");
+                    return 1;
+                }
+                break;
+            case 'r':
+                seed_rows = parse_nonnegative_int(optarg);
+                if (seed_rows < 0) {
+                    printf("Error: Seed rows must be zero or a positive number\n");
+                    return 1;
+                }
+                break;
+            case 'R':
+                report_similarity = 1;
+                break;
+            case 'V':
+                verify = 1;
+                break;
+            case 'e':
+                perf_counters = 1;
+                break;
+            case 'w':
+                mt_options.wait_report = 1;
+                break;
+            case 'T':
+                mt_options.timeline_file = optarg;
+                break;
+            case 'p':
+                pipeline = 1;
+                break;
+            case 'q':
+                queue_rows = parse_positive_int(optarg);
+                if (queue_rows == 0) {
+                    printf("Error: Queue rows must be a positive number\n");
+                    return 1;
+                }
+                break;
+            case 'B':
+                batch_source = optarg;
+                break;
+            case 'o':
+                output_dir = optarg;
+                break;
+            case '1':
+                write_options.bit_depth = 1;
+                break;
+            case 'c':
+                write_options.compression_level = atoi(optarg);
+                if (write_options.compression_level < 0 || write_options.compression_level > 9) {
+                    printf("Error: Compression level must be 0-9\n");
+                    return 1;
+                }
+                break;
+            case 'f':
+                write_options.filters = lookup_named_value(png_filter_names, optarg);
+                if (write_options.filters < 0) {
+                    printf("Error: Unknown filter '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'z':
+                write_options.strategy = lookup_named_value(zlib_strategy_names, optarg);
+                if (write_options.strategy < 0) {
+                    printf("Error: Unknown strategy '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                // Dithered rows are mostly runs of 0/255, which RLE matches cheaply
+                write_options.compression_level = 1;
+                write_options.filters = PNG_FILTER_NONE;
+                write_options.strategy = Z_RLE;
+                break;
+            case 'g':
+                gray_kernel = find_grayscale_kernel(optarg);
+                if (!gray_kernel) {
+                    printf("Error: Grayscale kernel '%s' is unknown or not supported on this CPU\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'G':
+                printf("Checking grayscale kernels against rgb_to_grayscale:\n");
+                return check_grayscale_kernels();
+            case 'K':
+                return bench_error_kernels(4000, 3000, 3);
+            case 'C':
+                return print_cost_model();
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    int positional = argc - optind;
+
+    // "auto" never uses more threads than there are CPUs to run them on
+    int max_threads = mt_options.affinity ? affinity.count : online_cpus();
+    if (mt_options.affinity) {
+        int domains = 0;
+        printf("Pinning workers to CPU(s)");
+        for (int i = 0; i < affinity.count; i++) {
+            domains += (i == 0 || affinity.domains[i] != affinity.domains[i - 1]);
+            printf(" %d", affinity.cpus[i]);
+        }
+        printf(" (%d cache domain(s)).\n", domains);
+    }
+
+    // Batch mode: the only positional argument is the pool size
+    if (batch_source) {
+        if (positional > 1) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (pipeline || approx || verify || perf_counters) {
+            printf("Error: Batch mode does not support --pipeline, --approx, --verify or --perf-counters\n");
+            return 1;
+        }
+        int num_workers = (positional == 1) ? parse_thread_count(argv[optind]) : 0;
+        if (num_workers == 0) num_workers = max_threads;
+
+        BatchItem* items;
+        int num_items = load_batch_items(batch_source, output_dir, &items);
+        if (num_items < 0) return 1;
+        if (num_items == 0) {
+            printf("Error: No images found in %s\n", batch_source);
+            return 1;
+        }
+
+        printf("Running batch of %d image(s) on %d worker(s).\n", num_items, num_workers);
+        double start = get_time_seconds();
+        int failures = dither_batch(items, num_items, num_workers, kernel, serpentine, &mt_options,
+                                    gray_kernel->convert, &write_options);
+        double elapsed = get_time_seconds() - start;
+        printf("Batch finished: %d of %d image(s) in %.4f s (%.2f images/s).\n",
+               num_items - failures, num_items, elapsed, num_items / elapsed);
+
+        for (int i = 0; i < num_items; i++) {
+            free(items[i].input);
+            free(items[i].output);
+        }
+        free(items);
+        return failures ? 1 : 0;
+    }
+
+    if (positional != 2 && positional != 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char* input_file = argv[optind];
+    const char* image_output = argv[optind + 1];
+    // 0 (auto): pick from the cost model, or one per CPU where the model does not apply.
+    // -1 (omitted): one thread, or one per CPU for the pipeline and approximate modes.
+    int num_threads = (positional == 3) ? parse_thread_count(argv[optind + 2]) : -1;
+
+    if (verify && approx) {
+        printf("Error: --verify checks the exact engines; use --similarity with --approx\n");
+        return 1;
+    }
+    // The pipeline overlaps all phases, and the band threads of --approx are not counted
+    if (perf_counters && (pipeline || approx)) {
+        printf("Error: --perf-counters does not support --pipeline or --approx\n");
+        return 1;
+    }
+
+    // 0 for PNG, else PNM_GRAYMAP or PNM_BITMAP
+    int input_format = pnm_format_for_path(input_file);
+    int output_format = pnm_format_for_path(image_output);
+
+    if (input_format && output_format && pnm_same_file(input_file, image_output)) {
+        printf("Error: A PGM/PBM input cannot be dithered onto itself\n");
+        return 1;
+    }
+    if (pipeline) {
+        if (input_format || output_format) {
+            printf("Error: Pipeline mode overlaps PNG decode and encode; PGM/PBM files are mapped instead\n");
+            return 1;
+        }
+        if (kernel->matrix != &floyd_steinberg_matrix || serpentine || approx) {
+            printf("Error: Pipeline mode only supports exact floyd-steinberg, left to right\n");
+            return 1;
+        }
+        if (num_threads <= 0) num_threads = max_threads;
+        printf("Running three-stage pipeline with %d dither thread(s).\n", num_threads);
+        if (dither_png_pipeline(input_file, image_output, num_threads, queue_rows, &write_options, gray_kernel->convert) != 0) {
+            printf("Error: Pipeline failed for %s\n", input_file);
+            return 1;
+        }
+        int verify_failures = 0;
+        if (verify) {
+            verify_failures = verify_pipeline(input_file, image_output, num_threads, queue_rows, &write_options,
+                                              gray_kernel->convert);
+        }
+        printf("File %s finished.\n", image_output);
+        return verify_failures ? 1 : 0;
+    }
+
+    // Counters of this thread, read per phase; the dither phase adds those of the MT workers
+    PerfCounters perf;
+    PerfSample phase_counters[NUM_PHASES];
+    if (perf_counters && perf_counters_open(&perf) == 0) {
+        printf("Warning: No performance counters available (see perf_event_paranoid)\n");
+    }
+
+    // Decoding a PGM/PBM is only mapping it and parsing the header
+    PngImage *image = NULL;
+    PnmImage input_map;
+    if (perf_counters) perf_counters_start(&perf);
+    if (input_format) {
+        if (pnm_map_file(input_file, &input_map) != 0) return 1;
+    } else {
+        image = read_png_file(input_file);
+    }
+    if (perf_counters) perf_counters_stop(&perf, &phase_counters[PHASE_DECODE]);
+    if (!input_format && !image) {
+        printf("Error: Could not read %s\n", input_file);
+        return 1;
+    }
+    int width = input_format ? input_map.width : image->width;
+    int height = input_format ? input_map.height : image->height;
+
+    // A PGM output is dithered straight into its mapping, so it is created before the dither
+    PnmImage output_map;
+    ImageBuffer grayscale_view, dithered_view;
+    ImageBuffer* dithered;
+    if (output_format == PNM_GRAYMAP) {
+        if (pnm_create_file(image_output, PNM_GRAYMAP, width, height, &output_map) != 0) return 1;
+        dithered_view = (ImageBuffer){width, height, output_map.row_bytes, output_map.pixels};
+        dithered = &dithered_view;
+    } else {
+        dithered = create_image_buffer(width, height, 1);
+    }
+
+    // Convert to grayscale; an 8-bit PGM already is
+    ImageBuffer* grayscale;
+    if (perf_counters) perf_counters_start(&perf);
+    if (input_format) {
+        grayscale = pnm_input_plane(&input_map, &grayscale_view);
+    } else {
+        grayscale = create_image_buffer(width, height, 1);
+        for (int y = 0; grayscale && y < height; y++) {
+            // Assuming 4 bytes per pixel (RGBA) after png_set_filler/png_set_gray_to_rgb
+            gray_kernel->convert(image_row(image->pixels, y), image_row(grayscale, y), width);
+        }
+    }
+    if (perf_counters) perf_counters_stop(&perf, &phase_counters[PHASE_GRAYSCALE]);
+    if (!grayscale || !dithered) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+
+    // Let the cost model choose between ST and MT, and how many threads, for this shape
+    if (num_threads == 0 && !approx) {
+        CostModel model;
+        double predicted_ns;
+        get_cost_model(&model, 0);
+        num_threads = choose_thread_count(&model, kernel, &mt_options, serpentine, width, height,
+                                          max_threads, &predicted_ns);
+        printf("Cost model: %d thread(s) for %dx%d, predicted %.4f s (single-threaded %.4f s).\n",
+               num_threads, width, height, predicted_ns / 1e9,
+               predict_dither_ns(&model, kernel, &mt_options, serpentine, width, height, 1) / 1e9);
+    }
+
+    PerfSample* thread_counters = NULL;
+    if (perf_counters && num_threads > 1) {
+        thread_counters = (PerfSample*)calloc(num_threads, sizeof(PerfSample));
+        mt_options.thread_counters = thread_counters;
+    }
+
+    double start = get_time_seconds();
+    if (perf_counters) perf_counters_start(&perf);
+
+    if (approx) {
+        if (num_threads <= 0) num_threads = max_threads;
+        if (num_bands < 1) num_bands = num_threads;
+        printf("Running approximate band-parallel dithering: %d band(s), %d seed row(s), %d thread(s).\n",
+               num_bands, seed_rows, num_threads);
+        dither_image_bands(grayscale, dithered, num_threads, num_bands, seed_rows, kernel, serpentine,
+                           mt_options.affinity);
+    } else if (num_threads <= 1) {
+        printf("Running single-threaded dithering.\n");
+        dither_image_st(grayscale, dithered, kernel, serpentine);
+    } else {
+        printf("Running multi-threaded (%s) dithering with %d threads.\n",
+               serpentine ? "serpentine row hand-off" :
+               (mt_options.schedule == SCHEDULE_TILES) ? "work-stealing tiles" :
+               (mt_options.schedule == SCHEDULE_ROWS) ? "row pipeline" : "wavefront",
+               num_threads);
+        SyncCounters before, after;
+        read_sync_counters(&before);
+        dither_image_mt(grayscale, dithered, num_threads, &mt_options, kernel, serpentine);
+        read_sync_counters(&after);
+        printf("Synchronization: %ld futex wait(s), %ld futex wake(s), %ld context switch(es).\n",
+               after.futex_waits - before.futex_waits, after.futex_wakes - before.futex_wakes,
+               after.context_switches - before.context_switches);
+    }
+    if (perf_counters) perf_counters_stop(&perf, &phase_counters[PHASE_DITHER]);
+    for (int i = 0; thread_counters && i < num_threads; i++) {
+        perf_sample_add(&phase_counters[PHASE_DITHER], &thread_counters[i]);
+    }
+    // Later checks (--similarity, --verify) run the engines again without counting
+    mt_options.thread_counters = NULL;
+    mt_options.wait_report = 0;
+    mt_options.timeline_file = NULL;
+
+    // Compare against the exact result, which the approximate mode is meant to stand in for
+    if (report_similarity) {
+        double elapsed = get_time_seconds() - start;
+        ImageBuffer* exact = create_image_buffer(width, height, 1);
+        if (!exact) {
+            printf("Error: Memory allocation failed\n");
+            return 1;
+        }
+        double exact_start = get_time_seconds();
+        if (num_threads <= 1) {
+            dither_image_st(grayscale, exact, kernel, serpentine);
+        } else {
+            dither_image_mt(grayscale, exact, num_threads, &mt_options, kernel, serpentine);
+        }
+        double exact_elapsed = get_time_seconds() - exact_start;
+
+        long long differing;
+        double similarity = image_similarity(dithered, exact, &differing);
+        printf("Dither time: %.4f s, exact engine: %.4f s\n", elapsed, exact_elapsed);
+        printf("Similarity: %.2f%% (%lld of %lld pixels differ)\n", similarity * 100.0, differing,
+               (long long)width * height);
+        printf("Mean %dx%d tone error against the input: %.3f (exact engine: %.3f) gray levels\n",
+               TONE_BLOCK, TONE_BLOCK, block_tone_difference(dithered, grayscale, TONE_BLOCK),
+               block_tone_difference(exact, grayscale, TONE_BLOCK));
+        free_image_buffer(exact);
+    }
+
+    // Check every MT scheduler, with at least two threads even where the run itself was ST
+    int verify_failures = 0;
+    if (verify) {
+        int verify_threads = (num_threads > 1) ? num_threads : (max_threads > 1) ? max_threads : 2;
+        verify_failures = verify_mt_engines(grayscale, verify_threads, &mt_options, kernel, serpentine);
+    }
+    
+    // A PGM was written by the dither itself; a PBM is packed into its mapping
+    int write_failed = 0;
+    if (perf_counters) perf_counters_start(&perf);
+    if (output_format == PNM_BITMAP) {
+        write_failed = pnm_create_file(image_output, PNM_BITMAP, width, height, &output_map) != 0;
+        for (int y = 0; !write_failed && y < height; y++) {
+            pnm_pack_row(image_row(dithered, y), output_map.pixels + (size_t)y * output_map.row_bytes, width);
+        }
+    } else if (!output_format) {
+        write_failed = write_png_file(image_output, dithered, &write_options) != 0;
+        if (write_failed) printf("Error: Could not write %s\n", image_output);
+    }
+    if (output_format) pnm_unmap(&output_map);
+    if (perf_counters) perf_counters_stop(&perf, &phase_counters[PHASE_ENCODE]);
+    if (!write_failed) printf("File %s finished.\n", image_output);
+
+    // Per phase for the whole process, then per dither worker (user space only)
+    if (perf_counters) {
+        printf("Performance counters:\n");
+        perf_sample_print_header(stdout, "phase");
+        for (int phase = 0; phase < NUM_PHASES; phase++) {
+            perf_sample_print(stdout, phase_names[phase], &phase_counters[phase]);
+        }
+        for (int i = 0; thread_counters && i < num_threads; i++) {
+            char label[32];
+            snprintf(label, sizeof(label), "thread %d", i);
+            perf_sample_print(stdout, label, &thread_counters[i]);
+        }
+        perf_counters_close(&perf);
+        free(thread_counters);
+    }
+
+    // Cleanup; the views into mappings have nothing to free
+    if (grayscale != &grayscale_view) free_image_buffer(grayscale);
+    if (dithered != &dithered_view) free_image_buffer(dithered);
+    if (input_format) {
+        pnm_unmap(&input_map);
+    } else {
+        free_png_image(image);
+    }
+    free_cpu_list(&affinity);
+
+    return (verify_failures || write_failed) ? 1 : 0;
+}
+
+#endif // DITHER_NO_MAIN